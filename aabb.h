@@ -67,6 +67,29 @@ class aabb {
             return true;
         }
 
+        bool is_empty() const {
+            return x.min > x.max || y.min > y.max || z.min > z.max;
+        }
+
+        aabb intersect(const aabb& other) const {
+            // Overlap of the two boxes, padded like any other box unless it is empty
+            interval ix(std::fmax(x.min, other.x.min), std::fmin(x.max, other.x.max));
+            interval iy(std::fmax(y.min, other.y.min), std::fmin(y.max, other.y.max));
+            interval iz(std::fmax(z.min, other.z.min), std::fmin(z.max, other.z.max));
+            if (ix.min > ix.max || iy.min > iy.max || iz.min > iz.max)
+                return empty;
+            return aabb(ix, iy, iz);
+        }
+
+        glm::vec3 centroid() const {
+            return 0.5f * glm::vec3(x.min + x.max, y.min + y.max, z.min + z.max);
+        }
+
+        float surface_area() const {
+            float dx = x.size(), dy = y.size(), dz = z.size();
+            return 2 * (dx*dy + dy*dz + dz*dx);
+        }
+
         int longest_axis() const {
             if (x.size() > y.size())
                 return x.size() > z.size() ? 0 : 2;
@@ -82,6 +105,15 @@ class aabb {
             if (x.size() < delta) x = x.expand(delta);
             if (y.size() < delta) y = y.expand(delta);
             if (z.size() < delta) z = z.expand(delta);
+
+            // Far from the origin the padding can round away, leaving a flat box no ray hits (e.g., a
+            // wall on its own in a BVH leaf), so those are widened by a float step on each side
+            for (interval* axis : {&x, &y, &z}) {
+                if (axis->size() == 0) {
+                    axis->min = std::nextafter(axis->min, -infinity);
+                    axis->max = std::nextafter(axis->max, infinity);
+                }
+            }
         }
 };
 
@@ -2,91 +2,232 @@
 #define BVH_H
 
 #include "aabb.h"
+#include "bvh_build.h"
+#include "bvh_cache.h"
+#include "bvh_motion.h"
+#include "bvh_quantized.h"
+#include "bvh_stats.h"
+#include "bvh_wide.h"
 #include "hittable.h"
 #include "hittable_list.h"
 
-#include <algorithm>    
+#include <cstdint>
+#include <vector>
+
+struct bvh_linear_node {
+    // 32 bytes, so two nodes share a cache line
+    aabb bbox;
+    std::int32_t offset;    // Leaf: first object; interior node: second child (the first follows the node)
+    std::uint16_t count;    // Objects in a leaf, 0 for an interior node
+    std::uint8_t axis;      // Split axis of an interior node
+    std::uint8_t pad;
+};
+
+static_assert(sizeof(bvh_linear_node) == 32, "bvh_linear_node should be 32 bytes");
 
 class bvh_node : public hittable {
+    // The built tree is flattened into one array in depth-first order, and the objects are stored
+    // in leaf order so that each leaf's objects are contiguous
     public:
-        bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size()) {}
+        bvh_node(hittable_list list, const bvh_options& options = default_bvh_options())
+         : bvh_node(list.objects, 0, list.objects.size(), options) {}
 
-        bvh_node(std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end) 
+        bvh_node(std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end,
+                 const bvh_options& options = default_bvh_options())
+         : objects(objects.begin() + start, objects.begin() + end), options(options)
         {
-            // BVH is most effective when the objects are divided into two lists well,
-            // i.e., such that the two lists (children) have smaller bounding boxes than
-            // the current BVH (parent)
-
-            // Naive method: Split on random axis
-            // int axis = random_int(0, 2);
-
-            // Slightly better method: Split on longest axis
-            bbox = aabb::empty;
-            for (size_t object_index = start; object_index < end; object_index++)
-                bbox = aabb(bbox, objects[object_index]->bounding_box());
-            int axis = bbox.longest_axis();
-
-            auto comparator = (axis = 0) ? box_x_compare
-                            : (axis = 1) ? box_y_compare
-                                         : box_z_compare;
-
-            size_t object_span = end - start;
-
-            if (object_span == 1) {
-                left = right = objects[start];
-            } else if (object_span == 2) {
-                left = objects[start];
-                right = objects[start + 1];
-            } else {
-                // Sort by ascending min axis interval bound
-                std::sort(objects.begin() + start, objects.begin() + end, comparator);
+            build();
+        }
 
-                size_t mid = start + object_span/2;
-                left = std::make_shared<bvh_node>(objects, start, mid);
-                right = std::make_shared<bvh_node>(objects, mid, end);
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (nodes.empty())
+                return false;
+
+            // Depth-first traversal: descend into the near child, keeping far children on a stack. A far
+            // child's box is tested when it is popped, against the interval shrunk by any hits found
+            // since, so it is culled if its entry lies beyond the closest hit.
+            bool dir_is_negative[3] = {r.direction().x < 0, r.direction().y < 0, r.direction().z < 0};
+            int stack[bvh_max_depth];
+            int stack_size = 0;
+            int node_index = 0;
+            int visited = 0;
+            bool hit_anything = false;
+
+            while (true) {
+                const bvh_linear_node& node = nodes[node_index];
+                visited++;
+                if (node.bbox.hit(r, ray_t)) {
+                    if (node.count == 0) {
+                        // The first child holds the lower side of the split
+                        if (ordered && dir_is_negative[node.axis]) {
+                            stack[stack_size++] = node_index + 1;
+                            node_index = node.offset;
+                        } else {
+                            stack[stack_size++] = node.offset;
+                            node_index++;
+                        }
+                        continue;
+                    }
+
+                    // Shrink the interval with every hit so farther objects are rejected early
+                    for (int i = node.offset; i < node.offset + node.count; i++) {
+                        if (leaf_objects[i]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                }
+
+                if (stack_size == 0)
+                    break;
+                node_index = stack[--stack_size];
             }
 
-            bbox = aabb(left->bounding_box(), right->bounding_box()); // Only if splitting on random axis
+            bvh_counters.queries++;
+            bvh_counters.nodes_visited += visited;
+            return hit_anything;
         }
 
-        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-            if (!bbox.hit(r, ray_t))
+        aabb bounding_box() const override { return bbox; }
+
+        bool refit() {
+            // Updates every box bottom-up from the objects' current bounding boxes, for objects that
+            // moved between frames (e.g., through translate::set_offset), and returns true if the tree
+            // had to be rebuilt instead
+            // - The tree keeps its structure, so it degrades as objects move away from the neighbors
+            //   they were grouped with. Once its SAH cost exceeds the cost of refitting it as built
+            //   (see unmoved_refit_cost) by options.refit_rebuild_threshold, it is rebuilt.
+            // - Objects that are BVHs themselves, or wrap one, must be refit first
+            // - Not safe while another thread is rendering with the tree
+            if (nodes.empty())
                 return false;
 
-            // Call hit() on hittable instead of aabb because we need to return hit info in rec
-            bool hit_left = left->hit(r, ray_t, rec);
-            // Slight optimization for second hit check if a hit occurred in hit_left
-            // by reducing max of interval to check
-            bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec); 
+            fit_boxes();
+            if (refit_cost() <= built_cost * (1 + options.refit_rebuild_threshold))
+                return false;
+            build(false);
+            return true;
+        }
 
-            return hit_left || hit_right;
+        float sah_cost() const {
+            // Expected cost of a ray through the root box: every node's traversal cost and every leaf's
+            // object count, weighted by the chance the ray enters its box (area relative to the root's)
+            if (nodes.empty())
+                return 0;
+            float cost = 0;
+            for (const auto& node : nodes)
+                cost += node.bbox.surface_area() * (node.count == 0 ? options.traversal_cost : node.count);
+            return cost / nodes[0].bbox.surface_area();
         }
 
-        aabb bounding_box() const override { return bbox; }
+        size_t memory_bytes() const {
+            return bvh_memory_bytes(nodes, leaf_objects);
+        }
+
+        bvh_stats stats() const {
+            bvh_stats stats("binary", nodes.size(), sah_cost(), memory_bytes());
+            stats.add_binary_tree(nodes, [](const bvh_linear_node& node) { return node.bbox; });
+            stats.finish();
+            return stats;
+        }
 
     private:
-        std::shared_ptr<hittable> left;
-        std::shared_ptr<hittable> right;
+        std::vector<bvh_linear_node> nodes;
+        std::vector<std::shared_ptr<hittable>> leaf_objects;
+        std::vector<std::shared_ptr<hittable>> objects;     // As given, for rebuilds
+        bvh_options options;
         aabb bbox;
+        bool ordered;
+        float built_cost;
+
+        void build(bool use_cache = true) {
+            bvh_build_result built = load_or_build_bvh(objects, 0, objects.size(), options, use_cache);
+            leaf_objects.swap(built.leaf_objects);
+            ordered = options.ordered_traversal;
+
+            bbox = built.root->bbox;
+            nodes.clear();
+            if (!leaf_objects.empty()) {
+                nodes.reserve(built.node_count);
+                flatten(*built.root);
+            }
+            built_cost = unmoved_refit_cost();
+            if (options.report_stats)
+                stats().print(std::clog);
+        }
 
-        static bool box_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b, int axis_index) {
-            // Compare based on interval min bound
-            interval a_axis_interval = a->bounding_box().axis_interval(axis_index);
-            interval b_axis_interval = b->bounding_box().axis_interval(axis_index);
-            return a_axis_interval.min < b_axis_interval.min;
+        void fit_boxes() {
+            // Sets every box from the objects' current bounding boxes. Children are stored after their
+            // parent, so a reverse sweep visits them first.
+            for (int i = int(nodes.size()) - 1; i >= 0; i--) {
+                bvh_linear_node& node = nodes[i];
+                if (node.count == 0) {
+                    node.bbox = aabb(nodes[i + 1].bbox, nodes[node.offset].bbox);
+                    continue;
+                }
+                node.bbox = aabb::empty;
+                for (int k = node.offset; k < node.offset + node.count; k++)
+                    node.bbox = aabb(node.bbox, leaf_objects[k]->bounding_box());
+            }
+            bbox = nodes[0].bbox;
         }
 
-        static bool box_x_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b) {
-            return box_compare(a, b, 0);
+        float unmoved_refit_cost() {
+            // The refit cost of the tree as built, before anything moves, for refit() to measure
+            // degradation against. It can be above the cost of the built boxes: SBVH leaves bound
+            // only the parts of split objects on their side, and a refit bounds whole objects.
+            if (nodes.empty())
+                return 0;
+            std::vector<bvh_linear_node> built_nodes = nodes;
+            fit_boxes();
+            float cost = refit_cost();
+            nodes.swap(built_nodes);
+            bbox = nodes[0].bbox;
+            return cost;
         }
 
-        static bool box_y_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b) {
-            return box_compare(a, b, 1);
+        float refit_cost() const {
+            return nodes.empty() ? 0 : bvh_refit_cost(sah_cost(), bbox.surface_area(), leaf_objects);
         }
 
-        static bool box_z_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b) {
-            return box_compare(a, b, 2);
+        int flatten(const bvh_build_node& build_node) {
+            int index = nodes.size();
+            nodes.push_back(bvh_linear_node());
+            nodes[index].bbox = build_node.bbox;
+            nodes[index].axis = build_node.axis;
+            nodes[index].pad = 0;
+
+            if (build_node.is_leaf()) {
+                nodes[index].offset = build_node.first;
+                nodes[index].count = build_node.count;
+            } else {
+                flatten(*build_node.children[0]);
+                int second = flatten(*build_node.children[1]);
+                nodes[index].offset = second;
+                nodes[index].count = 0;
+            }
+
+            return index;
         }
 };
 
+inline std::shared_ptr<hittable> make_bvh(hittable_list list, const bvh_options& options = default_bvh_options()) {
+    // BVH over list in the layout options.width and options.quantized select, or for binary trees a
+    // motion_bvh if options.motion_bounds is set and some objects move
+    if (options.motion_bounds && options.width == 2) {
+        for (const auto& object : list.objects)
+            if (motion_bvh::is_moving(*object))
+                return std::make_shared<motion_bvh>(list, options);
+    }
+    if (options.width == 8 && options.quantized)
+        return std::make_shared<bvh8_quantized>(list, options);
+    if (options.width == 8)
+        return std::make_shared<bvh8>(list, options);
+    if (options.width == 4 && options.quantized)
+        return std::make_shared<bvh4_quantized>(list, options);
+    if (options.width == 4)
+        return std::make_shared<bvh4>(list, options);
+    return std::make_shared<bvh_node>(list, options);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,238 @@
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+// BVH benchmarks over a field of random spheres, for comparing builders and tree layouts
+// - Build: bvh_node construction time for each builder at 1, 2, 4, ... threads up to the hardware
+//   concurrency
+// - Traversal: closest-hit queries for random rays from inside the field, per builder and layout
+//   width, with and without ordered traversal, as rays per second and nodes visited per ray
+// - Layout: memory and traversal speed of each node layout, uncompressed and quantized, over one SAH build
+// - Treelets: SAH cost, build time and traversal speed of each builder's trees, with and without
+//   treelet restructuring
+// - Motion: traversal at random ray times over spheres that move by up to a given distance, with
+//   whole-path bounds and with motion bounds (motion_bvh)
+
+hittable_list random_spheres(int count) {
+    hittable_list objects;
+    auto mat = std::make_shared<lambertian>(glm::vec3(.73, .73, .73));
+    for (int i = 0; i < count; i++)
+        objects.add(std::make_shared<sphere>(random_vector(0, 1000), random_float(0.5, 5), mat));
+    return objects;
+}
+
+const char* split_name(bvh_split split) {
+    switch (split) {
+        case bvh_split::median: return "median";
+        case bvh_split::sah:    return "sah";
+        case bvh_split::lbvh:   return "lbvh";
+        case bvh_split::sbvh:   return "sbvh";
+    }
+    return "";
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void build_benchmark(const hittable_list& objects) {
+    int max_threads = std::max(1, int(std::thread::hardware_concurrency()));
+
+    std::cout << "Build time, " << objects.objects.size() << " objects\n"
+              << "  builder  threads    seconds  speedup\n";
+    for (bvh_split split : {bvh_split::median, bvh_split::sah, bvh_split::lbvh, bvh_split::sbvh}) {
+        double single_thread = 0;
+        for (int threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+            bvh_options options;
+            options.split = split;
+            options.build_threads = threads;
+
+            auto start = std::chrono::steady_clock::now();
+            bvh_node bvh(objects, options);
+            double seconds = seconds_since(start);
+            if (threads == 1)
+                single_thread = seconds;
+
+            std::cout << "  " << std::setw(7) << split_name(split)
+                      << std::setw(9) << threads
+                      << std::setw(11) << std::fixed << std::setprecision(3) << seconds
+                      << std::setw(8) << std::setprecision(2) << single_thread / seconds << "x\n";
+
+            if (threads == max_threads)
+                break;
+        }
+    }
+}
+
+std::vector<ray> random_rays(int count) {
+    std::vector<ray> rays;
+    rays.reserve(count);
+    for (int i = 0; i < count; i++)
+        rays.push_back(ray(random_vector(0, 1000), random_unit_vector()));
+    return rays;
+}
+
+void traversal_benchmark(const hittable_list& objects, const std::vector<ray>& rays) {
+    std::cout << "Traversal, " << rays.size() << " rays\n"
+              << "  builder  width  ordered   Mrays/s  nodes/ray      hits\n";
+    for (bvh_split split : {bvh_split::median, bvh_split::sah, bvh_split::lbvh, bvh_split::sbvh}) {
+        for (int width : {2, 4, 8}) {
+            for (bool ordered : {false, true}) {
+                bvh_options options;
+                options.split = split;
+                options.width = width;
+                options.ordered_traversal = ordered;
+                std::shared_ptr<hittable> bvh = make_bvh(objects, options);
+
+                bvh_counters = bvh_traversal_counters();
+                int hits = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (const auto& r : rays) {
+                    hit_record rec;
+                    hits += bvh->hit(r, interval(0.001, infinity), rec);
+                }
+                double seconds = seconds_since(start);
+
+                std::cout << "  " << std::setw(7) << split_name(split)
+                          << std::setw(7) << width << std::setw(9) << (ordered ? "yes" : "no")
+                          << std::setw(10) << std::fixed << std::setprecision(2) << rays.size() / seconds / 1e6
+                          << std::setw(11) << std::setprecision(1) << bvh_counters.nodes_per_query()
+                          << std::setw(10) << hits << "\n";
+            }
+        }
+    }
+}
+
+template <typename T>
+void layout_row(const char* name, const hittable_list& objects, const std::vector<ray>& rays) {
+    T bvh(objects);
+
+    bvh_counters = bvh_traversal_counters();
+    int hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& r : rays) {
+        hit_record rec;
+        hits += bvh.hit(r, interval(0.001, infinity), rec);
+    }
+    double seconds = seconds_since(start);
+
+    std::cout << "  " << std::setw(12) << name
+              << std::setw(10) << std::fixed << std::setprecision(1) << bvh.memory_bytes() / 1e6
+              << std::setw(10) << std::setprecision(2) << rays.size() / seconds / 1e6
+              << std::setw(11) << std::setprecision(1) << bvh_counters.nodes_per_query()
+              << std::setw(10) << hits << "\n";
+}
+
+void layout_benchmark(const hittable_list& objects, const std::vector<ray>& rays) {
+    std::cout << "Layouts, " << rays.size() << " rays\n"
+              << "        layout        MB   Mrays/s  nodes/ray      hits\n";
+    layout_row<bvh_node>("binary", objects, rays);
+    layout_row<bvh4>("4-wide", objects, rays);
+    layout_row<bvh4_quantized>("4-wide 8-bit", objects, rays);
+    layout_row<bvh8>("8-wide", objects, rays);
+    layout_row<bvh8_quantized>("8-wide 8-bit", objects, rays);
+}
+
+void treelet_benchmark(const hittable_list& objects, const std::vector<ray>& rays) {
+    std::cout << "Treelets, " << rays.size() << " rays\n"
+              << "  builder  passes    seconds       SAH   Mrays/s  nodes/ray\n";
+    for (bvh_split split : {bvh_split::median, bvh_split::sah, bvh_split::lbvh, bvh_split::sbvh}) {
+        for (int passes : {0, 1, 3}) {
+            bvh_options options;
+            options.split = split;
+            options.treelet_passes = passes;
+
+            auto start = std::chrono::steady_clock::now();
+            bvh_node bvh(objects, options);
+            double build_seconds = seconds_since(start);
+
+            bvh_counters = bvh_traversal_counters();
+            start = std::chrono::steady_clock::now();
+            for (const auto& r : rays) {
+                hit_record rec;
+                bvh.hit(r, interval(0.001, infinity), rec);
+            }
+            double seconds = seconds_since(start);
+
+            std::cout << "  " << std::setw(7) << split_name(split) << std::setw(8) << passes
+                      << std::setw(11) << std::fixed << std::setprecision(3) << build_seconds
+                      << std::setw(10) << std::setprecision(1) << bvh.sah_cost()
+                      << std::setw(10) << std::setprecision(2) << rays.size() / seconds / 1e6
+                      << std::setw(11) << std::setprecision(1) << bvh_counters.nodes_per_query() << "\n";
+        }
+    }
+}
+
+void motion_benchmark(int count, const std::vector<ray>& rays) {
+    std::vector<ray> timed_rays;
+    timed_rays.reserve(rays.size());
+    for (const auto& r : rays)
+        timed_rays.push_back(ray(r.origin(), r.direction(), random_double()));
+
+    std::cout << "Motion, " << count << " objects, half moving, " << rays.size() << " rays\n"
+              << "  distance  bounds   Mrays/s  nodes/ray      hits\n";
+    auto mat = std::make_shared<lambertian>(glm::vec3(.73, .73, .73));
+    for (float distance : {1.0f, 10.0f, 50.0f}) {
+        hittable_list objects;
+        for (int i = 0; i < count; i++) {
+            glm::vec3 center = random_vector(0, 1000);
+            glm::vec3 center2 = (i % 2) ? center + distance * random_unit_vector() : center;
+            objects.add(std::make_shared<sphere>(center, center2, random_float(0.5, 5), mat));
+        }
+
+        for (bool motion : {false, true}) {
+            bvh_options options;
+            options.motion_bounds = motion;
+            std::shared_ptr<hittable> bvh = make_bvh(objects, options);
+
+            bvh_counters = bvh_traversal_counters();
+            int hits = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (const auto& r : timed_rays) {
+                hit_record rec;
+                hits += bvh->hit(r, interval(0.001, infinity), rec);
+            }
+            double seconds = seconds_since(start);
+
+            std::cout << "  " << std::setw(8) << std::fixed << std::setprecision(0) << distance
+                      << std::setw(8) << (motion ? "motion" : "path")
+                      << std::setw(10) << std::setprecision(2) << rays.size() / seconds / 1e6
+                      << std::setw(11) << std::setprecision(1) << bvh_counters.nodes_per_query()
+                      << std::setw(10) << hits << "\n";
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int num_objects = 1000000;
+    int num_rays = 1000000;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--objects" && i+1 < argc) {
+            num_objects = std::atoi(argv[++i]);
+        } else if (arg == "--rays" && i+1 < argc) {
+            num_rays = std::atoi(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--objects N] [--rays N]\n";
+            return 1;
+        }
+    }
+
+    hittable_list objects = random_spheres(num_objects);
+    build_benchmark(objects);
+    std::vector<ray> rays = random_rays(num_rays);
+    traversal_benchmark(objects, rays);
+    layout_benchmark(objects, rays);
+    treelet_benchmark(objects, rays);
+    motion_benchmark(num_objects, rays);
+}
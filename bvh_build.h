@@ -0,0 +1,1101 @@
+#ifndef BVH_BUILD_H
+#define BVH_BUILD_H
+
+#include "aabb.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class bvh_split {
+    median,     // Sort on the longest axis and split at the object count median
+    sah,        // Binned Surface Area Heuristic
+    lbvh,       // Linear BVH: sort by Morton code and split where the code's leading bit changes
+    sbvh        // Spatial split BVH: SAH, plus splits that clip objects straddling a plane into both children
+};
+
+struct bvh_options {
+    bvh_split split = bvh_split::sah;
+
+    // SAH: object centroids are binned along their longest axis and the node is split at the bin
+    // boundary with the lowest expected cost, or made a leaf if that is cheaper still. Costs are
+    // relative to intersecting one object.
+    int sah_bins         = 16;
+    float traversal_cost = 1;   // Testing a node's bounding box
+
+    // LBVH: Morton code length, 30 (10 bits per axis) or 63 (21 bits per axis). Longer codes separate
+    // objects closer together, at the cost of more radix sort passes.
+    int morton_bits = 63;
+
+    // SBVH: a spatial split is tried where the object split's children overlap by more than
+    // sbvh_overlap_threshold of the root's surface area, and is taken if its SAH cost is lower.
+    // Objects it splits are referenced from both children, and the build stops splitting once the
+    // extra references reach sbvh_duplication_budget times the object count.
+    float sbvh_overlap_threshold  = 1e-5f;
+    float sbvh_duplication_budget = 0.25f;
+
+    // Leaves hold up to this many objects, stored contiguously and tested in one loop. Larger leaves
+    // make shallower trees with fewer box tests; the SAH still splits a node that fits in a leaf
+    // when splitting is cheaper.
+    int max_leaf_size = 4;
+
+    // Children per node: 2, or 4 or 8 for a tree collapsed from the binary one whose child boxes are
+    // tested together with SIMD instructions (see make_bvh)
+    int width = 2;
+
+    // Store wide nodes' child boxes as 8-bit grid coordinates (see quantized_bvh_node), trading a
+    // decode per node and slightly larger boxes for about half the memory traffic. Widths 4 and 8 only.
+    bool quantized = false;
+
+    // Traverse the child on the ray's side of each split first, so that the closest hit is found
+    // early and farther children are culled against it
+    bool ordered_traversal = true;
+
+    // Treelet restructuring after the build, with any builder (see bvh_treelet_optimizer): each pass
+    // rearranges every treelet of up to treelet_leaves subtrees into the arrangement with the lowest
+    // SAH cost. 0 passes = off.
+    int treelet_passes = 0;
+    int treelet_leaves = 7;
+
+    // Binary trees over objects that move during the shutter interval store node bounds at both ends
+    // of it and blend them to each ray's time (see motion_bvh), instead of bounding whole paths
+    bool motion_bounds = true;
+
+    // Print each tree's bvh_stats to std::clog when it is built
+    bool report_stats = false;
+
+    // Directory of BVH cache files (see bvh_cache.h); empty to always build
+    std::string cache_dir;
+
+    // Refit: a tree whose SAH cost has grown by more than this fraction of its cost when built is
+    // rebuilt instead (see bvh_node::refit)
+    float refit_rebuild_threshold = 0.5f;
+
+    // Parallel construction: subtrees of at least parallel_task_size objects are built as separate
+    // tasks, and nodes of at least parallel_bin_size objects compute their bounds and bins in chunks
+    // on the threads that are idle. The tree is the same for any number of threads.
+    int build_threads         = 0;      // 0 = hardware concurrency
+    size_t parallel_task_size = 4096;
+    size_t parallel_bin_size  = 65536;
+};
+
+inline bvh_options& default_bvh_options() {
+    // Used by every bvh_node built without explicit options, so the command line can pick the builder
+    static bvh_options options;
+    return options;
+}
+
+// Traversal keeps a fixed-size stack of nodes still to visit, so trees are kept shallower than this
+const int bvh_max_depth = 64;
+
+struct bvh_traversal_counters {
+    // Work done by this thread's BVH queries, for benchmarks. A wide BVH node counts once, however
+    // many children it has.
+    long long queries = 0;
+    long long nodes_visited = 0;
+
+    double nodes_per_query() const { return queries ? double(nodes_visited) / queries : 0; }
+};
+
+thread_local bvh_traversal_counters bvh_counters;
+
+struct bvh_primitive {
+    // What the builder knows about an object
+    aabb bbox;
+    glm::vec3 centroid;
+    bool splittable;    // SBVH: whether the object may be referenced from more than one leaf
+    size_t index;       // Into the list of objects being built over
+};
+
+struct bvh_build_node {
+    // Node of the tree a builder produces, before it is flattened for traversal
+    aabb bbox;
+    std::unique_ptr<bvh_build_node> children[2];    // Both null in a leaf
+    int axis;                                       // Axis the children were split on
+    size_t first, count;                            // Leaf: range of the builder's primitives
+
+    bool is_leaf() const { return !children[0]; }
+};
+
+class bvh_builder {
+    // Builds a binary tree over primitives, reordering them so every leaf covers a contiguous range
+    public:
+        std::atomic<int> node_count;
+
+        // SBVH: bounds of the part of object index inside region. Unset, the object's bounding box is
+        // clipped to the region.
+        std::function<aabb(size_t index, const aabb& region)> clip_object;
+
+        bvh_builder(const bvh_options& options) : node_count(0), options(options), busy_threads(0) {
+            // Leaf counts must fit the node layouts' count fields
+            max_leaf_objects = std::min(std::max(options.max_leaf_size, 1), 255);
+            threads = (options.build_threads > 0) ? options.build_threads
+                                                  : std::max(1, int(std::thread::hardware_concurrency()));
+        }
+
+        std::unique_ptr<bvh_build_node> build(std::vector<bvh_primitive>& primitives) {
+            node_count = 0;
+            busy_threads = 1;
+            if (options.split == bvh_split::lbvh)
+                return build_lbvh(primitives);
+            if (options.split == bvh_split::sbvh)
+                return build_sbvh(primitives);
+            return build(primitives, 0, primitives.size(), 0);
+        }
+
+    private:
+        bvh_options options;
+        int threads;
+        std::atomic<int> busy_threads;  // Threads currently building
+        size_t max_leaf_objects;
+        float sbvh_root_area;
+        size_t sbvh_references_left;    // Duplicate references the SBVH build may still make
+
+        std::unique_ptr<bvh_build_node> build(std::vector<bvh_primitive>& primitives, size_t start, size_t end, int depth) {
+            // BVH is most effective when the objects are divided into two lists well,
+            // i.e., such that the two lists (children) have smaller bounding boxes than
+            // the current BVH (parent)
+            std::unique_ptr<bvh_build_node> node(new bvh_build_node());
+            node_count++;
+
+            chunk_threads chunks(*this, end - start);
+            std::vector<aabb> chunk_bounds(chunks, aabb::empty);
+            for_each_chunk(start, end, chunks, [&](int chunk, size_t chunk_start, size_t chunk_end) {
+                for (size_t i = chunk_start; i < chunk_end; i++)
+                    chunk_bounds[chunk] = aabb(chunk_bounds[chunk], primitives[i].bbox);
+            });
+            chunks.release();
+            node->bbox = aabb::empty;
+            for (const auto& bounds : chunk_bounds)
+                node->bbox = aabb(node->bbox, bounds);
+
+            // The median split halves the objects at every level, so it always finishes within the depth limit
+            size_t mid = (options.split == bvh_split::sah && depth < bvh_max_depth/2)
+                       ? sah_partition(primitives, start, end, node->bbox, node->axis)
+                       : median_partition(primitives, start, end, node->bbox, node->axis);
+
+            if (mid == start) {
+                node->first = start;
+                node->count = end - start;
+            } else {
+                build_children(*node, end - start, [&](int child) {
+                    return (child == 0) ? build(primitives, start, mid, depth + 1)
+                                        : build(primitives, mid, end, depth + 1);
+                });
+            }
+
+            return node;
+        }
+
+        template <typename F>
+        void build_children(bvh_build_node& node, size_t span, F build_child) {
+            // Sets node's children to build_child(0) and build_child(1), building the first on another
+            // thread while this one builds the second if the subtree is large and a thread is free
+            if (span >= options.parallel_task_size && claim_thread()) {
+                std::thread task([&]() { node.children[0] = build_child(0); });
+                node.children[1] = build_child(1);
+                task.join();
+                busy_threads--;
+            } else {
+                node.children[0] = build_child(0);
+                node.children[1] = build_child(1);
+            }
+        }
+
+        bool claim_thread() {
+            int busy = busy_threads;
+            while (busy < threads) {
+                if (busy_threads.compare_exchange_weak(busy, busy + 1))
+                    return true;
+            }
+            return false;
+        }
+
+        class chunk_threads {
+            // Number of chunks to split a node's work into: large nodes near the root take the threads
+            // not busy with subtrees, claimed from the same budget as build_children's tasks so nested
+            // parallel work never runs more than options.build_threads. They are given back by
+            // release(), or when this goes out of scope.
+            public:
+                chunk_threads(bvh_builder& builder, size_t span) : builder(builder), count(1) {
+                    if (span >= builder.options.parallel_bin_size) {
+                        while (builder.claim_thread())
+                            count++;
+                    }
+                }
+                ~chunk_threads() { release(); }
+
+                void release() {
+                    builder.busy_threads -= count - 1;
+                    count = 1;
+                }
+
+                operator int() const { return count; }
+
+            private:
+                bvh_builder& builder;
+                int count;
+
+                chunk_threads(const chunk_threads&) = delete;
+                chunk_threads& operator=(const chunk_threads&) = delete;
+        };
+
+        template <typename F>
+        static void for_each_chunk(size_t start, size_t end, int chunks, F f) {
+            // Calls f(chunk, chunk_start, chunk_end) for consecutive chunks of [start, end), all but the
+            // first on threads of their own
+            size_t span = end - start;
+            std::vector<std::thread> workers;
+            for (int chunk = 1; chunk < chunks; chunk++)
+                workers.emplace_back(f, chunk, start + span*chunk/chunks, start + span*(chunk+1)/chunks);
+            f(0, start, start + span/chunks);
+            for (auto& worker : workers)
+                worker.join();
+        }
+
+        // LBVH (Lauterbach et al. 2009, Karras 2012)
+        // - Centroids are quantized to a grid over their bounds and the grid coordinates' bits are
+        //   interleaved into Morton codes, which order the objects along a Z-order curve
+        // - After sorting by code, the objects under any node of the implicit octree-like hierarchy are
+        //   a contiguous range sharing a code prefix, so a node splits where its first differing bit flips
+        // - Each level is a binary search per node and the sort is linear, so builds take a fraction of
+        //   the time of a SAH build, at some cost in tree quality
+
+        struct morton_primitive {
+            std::uint64_t code;
+            std::uint32_t index;    // Into the primitives
+        };
+
+        static std::uint64_t spread_bits(std::uint64_t v) {
+            // Moves bit i of the low 21 bits of v to bit 3i
+            v &= 0x1fffff;
+            v = (v | v << 32) & 0x1f00000000ffffull;
+            v = (v | v << 16) & 0x1f0000ff0000ffull;
+            v = (v | v << 8)  & 0x100f00f00f00f00full;
+            v = (v | v << 4)  & 0x10c30c30c30c30c3ull;
+            v = (v | v << 2)  & 0x1249249249249249ull;
+            return v;
+        }
+
+        std::unique_ptr<bvh_build_node> build_lbvh(std::vector<bvh_primitive>& primitives) {
+            size_t n = primitives.size();
+            chunk_threads chunks(*this, n);
+            int axis_bits = (options.morton_bits >= 63) ? 21 : 10;
+
+            std::vector<glm::vec3> chunk_min(chunks, glm::vec3(infinity)), chunk_max(chunks, glm::vec3(-infinity));
+            for_each_chunk(0, n, chunks, [&](int chunk, size_t chunk_start, size_t chunk_end) {
+                for (size_t i = chunk_start; i < chunk_end; i++) {
+                    chunk_min[chunk] = glm::min(chunk_min[chunk], primitives[i].centroid);
+                    chunk_max[chunk] = glm::max(chunk_max[chunk], primitives[i].centroid);
+                }
+            });
+            glm::vec3 centroid_min(infinity), centroid_max(-infinity);
+            for (int chunk = 0; chunk < chunks; chunk++) {
+                centroid_min = glm::min(centroid_min, chunk_min[chunk]);
+                centroid_max = glm::max(centroid_max, chunk_max[chunk]);
+            }
+
+            // Grid cells per unit length on each axis; flat axes all map to cell 0
+            float cells = float((1u << axis_bits) - 1);
+            glm::vec3 extent = centroid_max - centroid_min;
+            glm::vec3 scale(extent.x > 0 ? cells / extent.x : 0,
+                            extent.y > 0 ? cells / extent.y : 0,
+                            extent.z > 0 ? cells / extent.z : 0);
+
+            std::vector<morton_primitive> codes(n);
+            for_each_chunk(0, n, chunks, [&](int, size_t chunk_start, size_t chunk_end) {
+                for (size_t i = chunk_start; i < chunk_end; i++) {
+                    glm::vec3 cell = glm::min((primitives[i].centroid - centroid_min) * scale, glm::vec3(cells));
+                    codes[i].code = spread_bits(std::uint64_t(cell.x)) << 2
+                                  | spread_bits(std::uint64_t(cell.y)) << 1
+                                  | spread_bits(std::uint64_t(cell.z));
+                    codes[i].index = i;
+                }
+            });
+            radix_sort(codes, 3 * axis_bits, chunks);
+
+            std::vector<bvh_primitive> sorted(n);
+            for_each_chunk(0, n, chunks, [&](int, size_t chunk_start, size_t chunk_end) {
+                for (size_t i = chunk_start; i < chunk_end; i++)
+                    sorted[i] = primitives[codes[i].index];
+            });
+            primitives.swap(sorted);
+            chunks.release();
+
+            return emit_lbvh(primitives, codes, 0, n, 3 * axis_bits - 1, 0);
+        }
+
+        void radix_sort(std::vector<morton_primitive>& codes, int bits, int chunks) const {
+            // Least significant digit first, one byte per pass. Each chunk counts its digits, the counts
+            // are turned into per-chunk output offsets, and each chunk scatters its part; this keeps
+            // every pass stable.
+            std::vector<morton_primitive> scattered(codes.size());
+            std::vector<std::vector<size_t>> offsets(chunks, std::vector<size_t>(256));
+
+            for (int shift = 0; shift < bits; shift += 8) {
+                for_each_chunk(0, codes.size(), chunks, [&](int chunk, size_t chunk_start, size_t chunk_end) {
+                    std::fill(offsets[chunk].begin(), offsets[chunk].end(), 0);
+                    for (size_t i = chunk_start; i < chunk_end; i++)
+                        offsets[chunk][(codes[i].code >> shift) & 0xff]++;
+                });
+
+                size_t total = 0;
+                for (int digit = 0; digit < 256; digit++) {
+                    for (int chunk = 0; chunk < chunks; chunk++) {
+                        size_t count = offsets[chunk][digit];
+                        offsets[chunk][digit] = total;
+                        total += count;
+                    }
+                }
+
+                for_each_chunk(0, codes.size(), chunks, [&](int chunk, size_t chunk_start, size_t chunk_end) {
+                    for (size_t i = chunk_start; i < chunk_end; i++)
+                        scattered[offsets[chunk][(codes[i].code >> shift) & 0xff]++] = codes[i];
+                });
+                codes.swap(scattered);
+            }
+        }
+
+        std::unique_ptr<bvh_build_node> emit_lbvh(const std::vector<bvh_primitive>& primitives,
+                                                  const std::vector<morton_primitive>& codes,
+                                                  size_t start, size_t end, int bit, int depth) {
+            std::unique_ptr<bvh_build_node> node(new bvh_build_node());
+            node_count++;
+
+            size_t object_span = end - start;
+            if (object_span <= max_leaf_objects) {
+                node->bbox = aabb::empty;
+                for (size_t i = start; i < end; i++)
+                    node->bbox = aabb(node->bbox, primitives[i].bbox);
+                node->axis = node->bbox.longest_axis();
+                node->first = start;
+                node->count = object_span;
+                return node;
+            }
+
+            // The codes in the range share every bit above bit. Skip bits they also share, and split
+            // where the first differing one flips from 0 to 1.
+            size_t mid = start + object_span/2;
+            bool split_on_bit = false;
+            for (; bit >= 0 && depth < bvh_max_depth/2; bit--) {
+                std::uint64_t mask = std::uint64_t(1) << bit;
+                if ((codes[start].code & mask) == (codes[end-1].code & mask))
+                    continue;
+
+                mid = std::partition_point(codes.begin() + start, codes.begin() + end,
+                    [mask](const morton_primitive& m) { return !(m.code & mask); }) - codes.begin();
+                node->axis = 2 - bit % 3;   // Codes interleave x, y, z from the most significant bit
+                split_on_bit = true;
+                break;
+            }
+            // Otherwise the objects have identical codes, or are past the depth where only balanced
+            // splits are safe, and are split in the middle of the range
+
+            build_children(*node, object_span, [&](int child) {
+                return (child == 0) ? emit_lbvh(primitives, codes, start, mid, bit - 1, depth + 1)
+                                    : emit_lbvh(primitives, codes, mid, end, bit - 1, depth + 1);
+            });
+            node->bbox = aabb(node->children[0]->bbox, node->children[1]->bbox);
+            if (!split_on_bit)
+                node->axis = node->bbox.longest_axis();
+
+            return node;
+        }
+
+        // Partitioning: reorder primitives[start, end) and return where the second child begins, or start
+        // to make the node a leaf
+
+        size_t median_partition(std::vector<bvh_primitive>& primitives, size_t start, size_t end,
+                                const aabb& bbox, int& axis) const {
+            // Naive method: Split on random axis
+            // int axis = random_int(0, 2);
+
+            // Slightly better method: Split on longest axis
+            size_t object_span = end - start;
+            axis = bbox.longest_axis();
+            if (object_span <= max_leaf_objects)
+                return start;
+
+            // Sort by ascending min axis interval bound
+            std::sort(primitives.begin() + start, primitives.begin() + end,
+                [axis](const bvh_primitive& a, const bvh_primitive& b) {
+                    return a.bbox.axis_interval(axis).min < b.bbox.axis_interval(axis).min;
+                });
+
+            return start + object_span/2;
+        }
+
+        struct object_split {
+            // Binned SAH split: objects whose centroid falls in a bin below boundary go left
+            int axis;
+            float bin_origin, bin_scale;
+            int num_bins;
+            int boundary;           // 0 if no boundary separates the objects
+            float cost;             // area(left) * count(left) + area(right) * count(right)
+            aabb left_bounds, right_bounds;
+
+            int bin_of(const bvh_primitive& p) const {
+                return std::min(int((p.centroid[axis] - bin_origin) * bin_scale), num_bins - 1);
+            }
+        };
+
+        size_t sah_partition(std::vector<bvh_primitive>& primitives, size_t start, size_t end,
+                             const aabb& bbox, int& axis) {
+            size_t object_span = end - start;
+            axis = bbox.longest_axis();
+            if (object_span == 1)
+                return start;
+
+            object_split split = find_object_split(primitives, start, end);
+            if (split.boundary == 0) {
+                // All centroids coincide, so no bin boundary separates them; any split is as good as another
+                return (object_span <= max_leaf_objects) ? start : start + object_span/2;
+            }
+            axis = split.axis;
+
+            float split_cost = options.traversal_cost + split.cost / bbox.surface_area();
+            float leaf_cost = object_span;
+            if (object_span <= max_leaf_objects && leaf_cost <= split_cost)
+                return start;
+
+            auto second = std::partition(primitives.begin() + start, primitives.begin() + end,
+                [&](const bvh_primitive& p) { return split.bin_of(p) < split.boundary; });
+            return second - primitives.begin();
+        }
+
+        object_split find_object_split(const std::vector<bvh_primitive>& primitives, size_t start, size_t end) {
+            // Binned SAH: the expected cost of a split is
+            //     traversal_cost + (area(left) * count(left) + area(right) * count(right)) / area(node)
+            // - i.e., the chance a ray through the node hits each child's box times the objects it then tests
+            // - Objects are binned by centroid and only bin boundaries are considered, which finds nearly
+            //   as good a split as trying every object boundary in linear time
+            size_t object_span = end - start;
+            object_split split;
+            split.boundary = 0;
+            split.cost = infinity;
+
+            // Per-chunk results are merged in chunk order, so the split doesn't depend on the chunking
+            chunk_threads chunks(*this, object_span);
+            std::vector<glm::vec3> chunk_min(chunks, glm::vec3(infinity)), chunk_max(chunks, glm::vec3(-infinity));
+            for_each_chunk(start, end, chunks, [&](int chunk, size_t chunk_start, size_t chunk_end) {
+                for (size_t i = chunk_start; i < chunk_end; i++) {
+                    chunk_min[chunk] = glm::min(chunk_min[chunk], primitives[i].centroid);
+                    chunk_max[chunk] = glm::max(chunk_max[chunk], primitives[i].centroid);
+                }
+            });
+            glm::vec3 centroid_min(infinity), centroid_max(-infinity);
+            for (int chunk = 0; chunk < chunks; chunk++) {
+                centroid_min = glm::min(centroid_min, chunk_min[chunk]);
+                centroid_max = glm::max(centroid_max, chunk_max[chunk]);
+            }
+            glm::vec3 extent = centroid_max - centroid_min;
+            split.axis = (extent.x > extent.y) ? (extent.x > extent.z ? 0 : 2)
+                                               : (extent.y > extent.z ? 1 : 2);
+            if (!(extent[split.axis] > 0))
+                return split;
+
+            int num_bins = std::max(2, options.sah_bins);
+            split.num_bins = num_bins;
+            split.bin_scale = num_bins / extent[split.axis];
+            split.bin_origin = centroid_min[split.axis];
+
+            std::vector<std::vector<int>> chunk_count(chunks, std::vector<int>(num_bins, 0));
+            std::vector<std::vector<aabb>> chunk_bins(chunks, std::vector<aabb>(num_bins, aabb::empty));
+            for_each_chunk(start, end, chunks, [&](int chunk, size_t chunk_start, size_t chunk_end) {
+                for (size_t i = chunk_start; i < chunk_end; i++) {
+                    int b = split.bin_of(primitives[i]);
+                    chunk_count[chunk][b]++;
+                    chunk_bins[chunk][b] = aabb(chunk_bins[chunk][b], primitives[i].bbox);
+                }
+            });
+            std::vector<int> bin_count(num_bins, 0);
+            std::vector<aabb> bin_bounds(num_bins, aabb::empty);
+            for (int chunk = 0; chunk < chunks; chunk++) {
+                for (int b = 0; b < num_bins; b++) {
+                    bin_count[b] += chunk_count[chunk][b];
+                    bin_bounds[b] = aabb(bin_bounds[b], chunk_bins[chunk][b]);
+                }
+            }
+
+            // Sweep from the right to get the right-hand term of every boundary, then from the left
+            // to complete it. Boundary b separates bins [0, b) from [b, num_bins).
+            std::vector<float> right_cost(num_bins, 0);
+            std::vector<aabb> right_bounds(num_bins, aabb::empty);
+            aabb bounds = aabb::empty;
+            int right_count = 0;
+            for (int b = num_bins - 1; b > 0; b--) {
+                bounds = aabb(bounds, bin_bounds[b]);
+                right_bounds[b] = bounds;
+                right_count += bin_count[b];
+                if (right_count > 0)
+                    right_cost[b] = right_count * bounds.surface_area();
+            }
+
+            aabb left_bounds = aabb::empty;
+            int left_count = 0;
+            for (int b = 1; b < num_bins; b++) {
+                left_bounds = aabb(left_bounds, bin_bounds[b-1]);
+                left_count += bin_count[b-1];
+                if (left_count == 0 || size_t(left_count) == object_span)
+                    continue;
+
+                float cost = left_count * left_bounds.surface_area() + right_cost[b];
+                if (cost < split.cost) {
+                    split.cost = cost;
+                    split.boundary = b;
+                    split.left_bounds = left_bounds;
+                    split.right_bounds = right_bounds[b];
+                }
+            }
+
+            return split;
+        }
+
+        // SBVH (Stich et al. 2009)
+        // - Besides the best object split, nodes consider spatial splits: a plane cuts the node, and an
+        //   object straddling it is referenced from both children, each reference bounding only the part
+        //   of the object on its side (see hittable::clipped_bounding_box)
+        // - Large objects, like walls, then no longer stretch every node they are in, so sibling boxes
+        //   overlap less and rays enter fewer nodes
+        // - The build works on lists of references, whose number grows with each spatial split. It runs
+        //   on one thread and emits leaves in depth-first order.
+
+        struct spatial_split {
+            // Plane at position on axis, and the bounds and counts its binning estimated for each side
+            int axis;
+            float position;
+            float cost;             // area(left) * count(left) + area(right) * count(right)
+            aabb left_bounds, right_bounds;
+            int left_count, right_count;
+        };
+
+        std::unique_ptr<bvh_build_node> build_sbvh(std::vector<bvh_primitive>& primitives) {
+            aabb root_bounds = aabb::empty;
+            for (const auto& p : primitives)
+                root_bounds = aabb(root_bounds, p.bbox);
+            sbvh_root_area = root_bounds.surface_area();
+            sbvh_references_left = size_t(primitives.size() * std::max(0.0f, options.sbvh_duplication_budget));
+
+            // primitives becomes the list of references in leaf order
+            std::vector<bvh_primitive> references;
+            references.swap(primitives);
+            return build_sbvh(references, 0, primitives);
+        }
+
+        std::unique_ptr<bvh_build_node> build_sbvh(std::vector<bvh_primitive>& references, int depth,
+                                                   std::vector<bvh_primitive>& leaves) {
+            std::unique_ptr<bvh_build_node> node(new bvh_build_node());
+            node_count++;
+
+            node->bbox = aabb::empty;
+            for (const auto& r : references)
+                node->bbox = aabb(node->bbox, r.bbox);
+
+            // Spatial splits don't always halve the references, so deep nodes fall back to median splits
+            std::vector<bvh_primitive> left, right;
+            if (depth < bvh_max_depth/2) {
+                sbvh_partition(references, node->bbox, node->axis, left, right);
+            } else {
+                size_t mid = median_partition(references, 0, references.size(), node->bbox, node->axis);
+                if (mid > 0) {
+                    left.assign(references.begin(), references.begin() + mid);
+                    right.assign(references.begin() + mid, references.end());
+                }
+            }
+
+            if (left.empty()) {
+                node->first = leaves.size();
+                node->count = references.size();
+                leaves.insert(leaves.end(), references.begin(), references.end());
+                return node;
+            }
+
+            std::vector<bvh_primitive>().swap(references);
+            node->children[0] = build_sbvh(left, depth + 1, leaves);
+            node->children[1] = build_sbvh(right, depth + 1, leaves);
+            return node;
+        }
+
+        void sbvh_partition(std::vector<bvh_primitive>& references, const aabb& bbox, int& axis,
+                            std::vector<bvh_primitive>& left, std::vector<bvh_primitive>& right) {
+            // Fills left and right with the children's references, or leaves them empty to make a leaf
+            size_t span = references.size();
+            axis = bbox.longest_axis();
+            if (span == 1)
+                return;
+
+            object_split object = find_object_split(references, 0, span);
+
+            // Spatial splits cost more to find and duplicate references, so they are only tried where the
+            // object split leaves children that overlap noticeably
+            spatial_split spatial;
+            spatial.cost = infinity;
+            aabb overlap = (object.boundary == 0) ? bbox : object.left_bounds.intersect(object.right_bounds);
+            if (sbvh_references_left > 0 && !overlap.is_empty()
+                && overlap.surface_area() > options.sbvh_overlap_threshold * sbvh_root_area)
+                spatial = find_spatial_split(references, bbox);
+
+            float split_cost = options.traversal_cost + std::fmin(object.cost, spatial.cost) / bbox.surface_area();
+            float leaf_cost = span;
+            if (span <= max_leaf_objects && leaf_cost <= split_cost)
+                return;
+
+            if (spatial.cost < object.cost && apply_spatial_split(references, spatial, left, right)) {
+                axis = spatial.axis;
+                return;
+            }
+
+            if (object.boundary == 0) {
+                // All centroids coincide and no spatial split helps
+                if (span > max_leaf_objects) {
+                    left.assign(references.begin(), references.begin() + span/2);
+                    right.assign(references.begin() + span/2, references.end());
+                }
+                return;
+            }
+
+            axis = object.axis;
+            for (const auto& r : references)
+                (object.bin_of(r) < object.boundary ? left : right).push_back(r);
+        }
+
+        spatial_split find_spatial_split(const std::vector<bvh_primitive>& references, const aabb& bbox) {
+            // The node is cut into equal-width bins along each axis and every reference is clipped to the
+            // bins it spans. A reference enters the bin it starts in and exits the one it ends in, so the
+            // references left of a boundary are those entering before it, and those right of it the ones
+            // exiting after it. Unsplittable references fall wholly into the bin of their centroid.
+            spatial_split split;
+            split.cost = infinity;
+
+            int num_bins = std::max(2, options.sah_bins);
+            std::vector<aabb> bin_bounds(num_bins), right_bounds(num_bins);
+            std::vector<int> entries(num_bins), exits(num_bins), right_count(num_bins);
+
+            for (int axis = 0; axis < 3; axis++) {
+                float origin = bbox.axis_interval(axis).min;
+                float bin_width = bbox.axis_interval(axis).size() / num_bins;
+                if (!(bin_width > 0))
+                    continue;
+
+                auto bin_at = [&](float position) {
+                    return std::min(std::max(int((position - origin) / bin_width), 0), num_bins - 1);
+                };
+
+                std::fill(bin_bounds.begin(), bin_bounds.end(), aabb::empty);
+                std::fill(entries.begin(), entries.end(), 0);
+                std::fill(exits.begin(), exits.end(), 0);
+                for (const auto& r : references) {
+                    int first = bin_at(r.splittable ? r.bbox.axis_interval(axis).min : r.centroid[axis]);
+                    int last = r.splittable ? bin_at(r.bbox.axis_interval(axis).max) : first;
+                    entries[first]++;
+                    exits[last]++;
+
+                    if (first == last) {
+                        bin_bounds[first] = aabb(bin_bounds[first], r.bbox);
+                        continue;
+                    }
+                    for (int b = first; b <= last; b++) {
+                        aabb clipped = clip_reference(r, axis, origin + b*bin_width, origin + (b+1)*bin_width);
+                        if (!clipped.is_empty())
+                            bin_bounds[b] = aabb(bin_bounds[b], clipped);
+                    }
+                }
+
+                aabb bounds = aabb::empty;
+                int count = 0;
+                for (int b = num_bins - 1; b > 0; b--) {
+                    bounds = aabb(bounds, bin_bounds[b]);
+                    count += exits[b];
+                    right_bounds[b] = bounds;
+                    right_count[b] = count;
+                }
+
+                bounds = aabb::empty;
+                count = 0;
+                for (int b = 1; b < num_bins; b++) {
+                    bounds = aabb(bounds, bin_bounds[b-1]);
+                    count += entries[b-1];
+                    if (count == 0 || right_count[b] == 0)
+                        continue;
+
+                    float cost = count * bounds.surface_area() + right_count[b] * right_bounds[b].surface_area();
+                    if (cost < split.cost) {
+                        split.axis = axis;
+                        split.position = origin + b*bin_width;
+                        split.cost = cost;
+                        split.left_bounds = bounds;
+                        split.right_bounds = right_bounds[b];
+                        split.left_count = count;
+                        split.right_count = right_count[b];
+                    }
+                }
+            }
+
+            return split;
+        }
+
+        bool apply_spatial_split(const std::vector<bvh_primitive>& references, const spatial_split& split,
+                                 std::vector<bvh_primitive>& left, std::vector<bvh_primitive>& right) {
+            // Returns false, leaving left and right empty, if a side would keep every reference
+            float left_area = split.left_bounds.surface_area();
+            float right_area = split.right_bounds.surface_area();
+            size_t duplicates = 0;
+
+            for (const auto& r : references) {
+                const interval& extent = r.bbox.axis_interval(split.axis);
+                if (!r.splittable) {
+                    (r.centroid[split.axis] < split.position ? left : right).push_back(r);
+                    continue;
+                }
+                if (extent.max <= split.position) {
+                    left.push_back(r);
+                    continue;
+                }
+                if (extent.min >= split.position) {
+                    right.push_back(r);
+                    continue;
+                }
+
+                // Reference unsplitting: a straddling reference goes wholly to one side if that is
+                // cheaper than splitting it, or if the duplication budget is spent
+                float split_cost = left_area * split.left_count + right_area * split.right_count;
+                float left_cost = aabb(split.left_bounds, r.bbox).surface_area() * split.left_count
+                                + right_area * (split.right_count - 1);
+                float right_cost = left_area * (split.left_count - 1)
+                                 + aabb(split.right_bounds, r.bbox).surface_area() * split.right_count;
+                bool budget_left = duplicates < sbvh_references_left;
+                if (!budget_left || std::fmin(left_cost, right_cost) <= split_cost) {
+                    (left_cost <= right_cost ? left : right).push_back(r);
+                    continue;
+                }
+
+                bvh_primitive left_part = r, right_part = r;
+                left_part.bbox = clip_reference(r, split.axis, extent.min, split.position);
+                right_part.bbox = clip_reference(r, split.axis, split.position, extent.max);
+                left_part.centroid = left_part.bbox.centroid();
+                right_part.centroid = right_part.bbox.centroid();
+
+                // The object may miss one side's part of its box altogether
+                if (left_part.bbox.is_empty()) {
+                    right.push_back(r);
+                } else if (right_part.bbox.is_empty()) {
+                    left.push_back(r);
+                } else {
+                    left.push_back(left_part);
+                    right.push_back(right_part);
+                    duplicates++;
+                }
+            }
+
+            if (left.size() == references.size() || right.size() == references.size()) {
+                left.clear();
+                right.clear();
+                return false;
+            }
+            sbvh_references_left -= duplicates;
+            return true;
+        }
+
+        aabb clip_reference(const bvh_primitive& reference, int axis, float min, float max) const {
+            // Bounds of the reference's object within its box, limited to [min, max] on axis
+            interval bounds[3] = {reference.bbox.x, reference.bbox.y, reference.bbox.z};
+            bounds[axis] = interval(std::fmax(bounds[axis].min, min), std::fmin(bounds[axis].max, max));
+            aabb region(bounds[0], bounds[1], bounds[2]);
+            return clip_object ? clip_object(reference.index, region) : reference.bbox.intersect(region);
+        }
+};
+
+inline float bvh_build_area_cost(const bvh_build_node& node, float traversal_cost) {
+    // Sum of every node's surface area times its cost: traversal_cost for an inner node, its object
+    // count for a leaf
+    if (node.is_leaf())
+        return node.bbox.surface_area() * node.count;
+    return node.bbox.surface_area() * traversal_cost + bvh_build_area_cost(*node.children[0], traversal_cost)
+                                                     + bvh_build_area_cost(*node.children[1], traversal_cost);
+}
+
+inline float bvh_build_sah_cost(const bvh_build_node& root, float traversal_cost) {
+    // SAH cost of a build tree, as bvh_node::sah_cost computes it for the flattened one
+    return bvh_build_area_cost(root, traversal_cost) / root.bbox.surface_area();
+}
+
+inline float bvh_refit_cost(float sah_cost, float root_area, const std::vector<std::shared_ptr<hittable>>& leaf_objects) {
+    // The cost refit() compares against the tree's cost when built: SAH cost relative to the objects'
+    // total box area instead of the root's, so it stays comparable as objects move and the root box
+    // grows or shrinks
+    float object_area = 0;
+    for (const auto& object : leaf_objects)
+        object_area += object->bounding_box().surface_area();
+    return sah_cost * root_area / object_area;
+}
+
+class bvh_treelet_optimizer {
+    // Treelet restructuring (Karras and Aila 2013), a pass over a built tree that lowers its SAH cost
+    // - A node's treelet is the node and the descendants reached by repeatedly expanding the treelet
+    //   leaf with the largest surface area, until there are treelet_leaves leaves. The leaves are
+    //   subtrees, left as they are; only the inner nodes above them are rearranged.
+    // - Dynamic programming over all subsets of the leaves finds the arrangement of the inner nodes
+    //   with the lowest total area. The leaves' own costs are the same in any arrangement.
+    // - Nodes are visited bottom-up, so a treelet is rearranged after the ones below it. Subtrees
+    //   below a cut near the root are optimized in parallel, and the nodes above the cut after them.
+    // - Arrangements that would make the tree as deep as bvh_max_depth are passed over
+    // - Leaves keep their primitive ranges, so the primitive order doesn't change
+    public:
+        bvh_treelet_optimizer(const bvh_options& options) : options(options) {
+            leaf_limit = std::min(std::max(options.treelet_leaves, 3), 12);
+            threads = (options.build_threads > 0) ? options.build_threads
+                                                  : std::max(1, int(std::thread::hardware_concurrency()));
+        }
+
+        void optimize(bvh_build_node& root) {
+            for (int pass = 0; pass < options.treelet_passes; pass++) {
+                // Cut the tree into enough subtrees to keep the threads busy, breadth-first
+                std::vector<std::pair<bvh_build_node*, int>> cut(1, std::make_pair(&root, 0));
+                std::vector<std::pair<bvh_build_node*, int>> above;     // Parents before children
+                while (threads > 1 && cut.size() < size_t(4 * threads)) {
+                    auto inner = std::find_if(cut.begin(), cut.end(), [](const std::pair<bvh_build_node*, int>& entry) {
+                        return !entry.first->is_leaf();
+                    });
+                    if (inner == cut.end())
+                        break;
+                    auto entry = *inner;
+                    cut.erase(inner);
+                    above.push_back(entry);
+                    cut.push_back(std::make_pair(entry.first->children[0].get(), entry.second + 1));
+                    cut.push_back(std::make_pair(entry.first->children[1].get(), entry.second + 1));
+                }
+
+                std::atomic<size_t> next(0);
+                auto worker = [&]() {
+                    treelet_scratch scratch(leaf_limit);
+                    for (size_t i = next++; i < cut.size(); i = next++)
+                        optimize_subtree(*cut[i].first, cut[i].second, scratch);
+                };
+                std::vector<std::thread> workers;
+                for (int t = 1; t < std::min(threads, int(cut.size())); t++)
+                    workers.emplace_back(worker);
+                worker();
+                for (auto& w : workers)
+                    w.join();
+
+                treelet_scratch scratch(leaf_limit);
+                for (auto entry = above.rbegin(); entry != above.rend(); ++entry)
+                    optimize_treelet(*entry->first, entry->second, scratch);
+            }
+        }
+
+    private:
+        struct treelet_split {
+            std::uint32_t first;    // Leaves under the first child
+            int axis;               // Split axis, or -1 to pick one from the children's centroids
+        };
+
+        struct treelet_scratch {
+            // Per subset of the treelet leaves
+            std::vector<aabb> boxes;
+            std::vector<float> cost;
+            std::vector<treelet_split> best, current;
+
+            treelet_scratch(int leaves)
+             : boxes(size_t(1) << leaves), cost(size_t(1) << leaves), best(size_t(1) << leaves),
+               current(size_t(1) << leaves) {}
+        };
+
+        bvh_options options;
+        int leaf_limit;
+        int threads;
+
+        void optimize_subtree(bvh_build_node& node, int depth, treelet_scratch& scratch) {
+            if (node.is_leaf())
+                return;
+            optimize_subtree(*node.children[0], depth + 1, scratch);
+            optimize_subtree(*node.children[1], depth + 1, scratch);
+            optimize_treelet(node, depth, scratch);
+        }
+
+        void optimize_treelet(bvh_build_node& root, int depth, treelet_scratch& scratch) {
+            if (root.is_leaf())
+                return;
+
+            // Form the treelet, recording its current arrangement: for each inner node, the leaves
+            // under it and under its first child
+            std::vector<std::unique_ptr<bvh_build_node>> leaves, inner;
+            std::vector<std::uint32_t> inner_leaves(1, 3);
+            leaves.push_back(std::move(root.children[0]));
+            leaves.push_back(std::move(root.children[1]));
+            scratch.current[3] = {1, root.axis};
+            while (int(leaves.size()) < leaf_limit) {
+                int largest = -1;
+                for (int i = 0; i < int(leaves.size()); i++) {
+                    if (!leaves[i]->is_leaf() && (largest < 0
+                     || leaves[i]->bbox.surface_area() > leaves[largest]->bbox.surface_area()))
+                        largest = i;
+                }
+                if (largest < 0)
+                    break;
+
+                // Leaf largest becomes its first child, and its second child is added as a new leaf
+                std::uint32_t bit = 1u << largest, new_bit = 1u << leaves.size();
+                for (auto& mask : inner_leaves) {
+                    treelet_split split = scratch.current[mask];
+                    if (split.first & bit)
+                        split.first |= new_bit;
+                    if (mask & bit)
+                        mask |= new_bit;
+                    scratch.current[mask] = split;
+                }
+                inner_leaves.push_back(bit | new_bit);
+                scratch.current[bit | new_bit] = {bit, leaves[largest]->axis};
+
+                std::unique_ptr<bvh_build_node> expanded = std::move(leaves[largest]);
+                leaves[largest] = std::move(expanded->children[0]);
+                leaves.push_back(std::move(expanded->children[1]));
+                inner.push_back(std::move(expanded));
+            }
+
+            int n = leaves.size();
+            std::uint32_t all = (1u << n) - 1;
+            float current_cost = 0;
+            for (std::uint32_t subset = 1; subset <= all; subset++) {
+                std::uint32_t lowest = subset & (~subset + 1);
+                int lowest_index = 0;
+                while (!((lowest >> lowest_index) & 1))
+                    lowest_index++;
+                if (subset == lowest) {
+                    scratch.boxes[subset] = leaves[lowest_index]->bbox;
+                    scratch.cost[subset] = 0;
+                    continue;
+                }
+                scratch.boxes[subset] = aabb(scratch.boxes[subset ^ lowest], scratch.boxes[lowest]);
+
+                // Each split of subset in two, once: the first part holds its lowest leaf
+                float best = infinity;
+                for (std::uint32_t part = (subset - 1) & subset; part != 0; part = (part - 1) & subset) {
+                    if (!(part & lowest))
+                        continue;
+                    float cost = scratch.cost[part] + scratch.cost[subset ^ part];
+                    if (cost < best) {
+                        best = cost;
+                        scratch.best[subset] = {part, -1};
+                    }
+                }
+                scratch.cost[subset] = options.traversal_cost * scratch.boxes[subset].surface_area() + best;
+            }
+            for (auto mask : inner_leaves)
+                current_cost += options.traversal_cost * scratch.boxes[mask].surface_area();
+
+            bool improved = scratch.cost[all] < current_cost * (1 - 1e-5f)
+                         && fits(scratch.best, all, depth, leaves);
+            assemble(root, improved ? scratch.best : scratch.current, all, leaves, inner, scratch.boxes);
+        }
+
+        static int height(const bvh_build_node& node) {
+            if (node.is_leaf())
+                return 0;
+            return 1 + std::max(height(*node.children[0]), height(*node.children[1]));
+        }
+
+        static bool fits(const std::vector<treelet_split>& splits, std::uint32_t subset, int depth,
+                         const std::vector<std::unique_ptr<bvh_build_node>>& leaves) {
+            // Whether the nodes of subset's subtree, at depth, stay shallower than bvh_max_depth
+            if ((subset & (subset - 1)) == 0) {
+                int index = 0;
+                while (!((subset >> index) & 1))
+                    index++;
+                return depth + height(*leaves[index]) < bvh_max_depth;
+            }
+            std::uint32_t first = splits[subset].first;
+            return fits(splits, first, depth + 1, leaves) && fits(splits, subset ^ first, depth + 1, leaves);
+        }
+
+        static std::unique_ptr<bvh_build_node> take(const std::vector<treelet_split>& splits, std::uint32_t subset,
+                                                    std::vector<std::unique_ptr<bvh_build_node>>& leaves,
+                                                    std::vector<std::unique_ptr<bvh_build_node>>& inner,
+                                                    const std::vector<aabb>& boxes) {
+            // The node over subset: a leaf, or one of the inner nodes given the arrangement in splits
+            if ((subset & (subset - 1)) == 0) {
+                int index = 0;
+                while (!((subset >> index) & 1))
+                    index++;
+                return std::move(leaves[index]);
+            }
+            std::unique_ptr<bvh_build_node> node = std::move(inner.back());
+            inner.pop_back();
+            assemble(*node, splits, subset, leaves, inner, boxes);
+            return node;
+        }
+
+        static void assemble(bvh_build_node& node, const std::vector<treelet_split>& splits, std::uint32_t subset,
+                             std::vector<std::unique_ptr<bvh_build_node>>& leaves,
+                             std::vector<std::unique_ptr<bvh_build_node>>& inner, const std::vector<aabb>& boxes) {
+            const treelet_split& split = splits[subset];
+            node.bbox = boxes[subset];
+            node.children[0] = take(splits, split.first, leaves, inner, boxes);
+            node.children[1] = take(splits, subset ^ split.first, leaves, inner, boxes);
+            node.axis = split.axis;
+            if (split.axis >= 0)
+                return;
+
+            // New splits: the axis the children's centroids are farthest apart on, with the lower child
+            // first, as the builders leave them for ordered traversal
+            glm::vec3 offset = node.children[1]->bbox.centroid() - node.children[0]->bbox.centroid();
+            node.axis = 0;
+            for (int axis = 1; axis < 3; axis++) {
+                if (std::fabs(offset[axis]) > std::fabs(offset[node.axis]))
+                    node.axis = axis;
+            }
+            if (offset[node.axis] < 0)
+                std::swap(node.children[0], node.children[1]);
+        }
+};
+
+struct bvh_build_result {
+    std::unique_ptr<bvh_build_node> root;
+    std::vector<std::shared_ptr<hittable>> leaf_objects;    // Objects in leaf order, repeated if split (SBVH)
+    std::vector<size_t> leaf_indices;                       // Their indices into the objects built over
+    int node_count;
+};
+
+inline bvh_build_result build_bvh(const std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end,
+                                  const bvh_options& options) {
+    std::vector<bvh_primitive> primitives;
+    primitives.reserve(end - start);
+    for (size_t object_index = start; object_index < end; object_index++) {
+        aabb box = objects[object_index]->bounding_box();
+        bool splittable = options.split == bvh_split::sbvh && objects[object_index]->splittable();
+        primitives.push_back({box, box.centroid(), splittable, object_index});
+    }
+
+    bvh_builder builder(options);
+    builder.clip_object = [&](size_t index, const aabb& region) {
+        return objects[index]->clipped_bounding_box(region);
+    };
+    bvh_build_result result;
+    result.root = builder.build(primitives);
+    result.node_count = builder.node_count;
+
+    if (options.treelet_passes > 0) {
+        float cost_before = bvh_build_sah_cost(*result.root, options.traversal_cost);
+        bvh_treelet_optimizer(options).optimize(*result.root);
+        std::clog << "Treelet optimization: SAH cost " << cost_before << " -> "
+                  << bvh_build_sah_cost(*result.root, options.traversal_cost) << std::endl;
+    }
+
+    result.leaf_objects.reserve(primitives.size());
+    result.leaf_indices.reserve(primitives.size());
+    for (const auto& p : primitives) {
+        result.leaf_objects.push_back(objects[p.index]);
+        result.leaf_indices.push_back(p.index);
+    }
+
+    return result;
+}
+
+#endif
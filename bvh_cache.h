@@ -0,0 +1,245 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "bvh_build.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// BVH cache files: a built tree and its object order, so runs over an unchanged scene skip the build
+// - Named by a hash of everything the build depends on: the bounding box of every object, in order,
+//   and the options that shape the tree. A scene or settings change gives a different name, so a
+//   stale file is never picked up.
+// - Mapped with mmap and checked before use: files of another version, for a different scene or with
+//   inconsistent contents, e.g., truncated, are ignored and replaced by a new build. A second hash of
+//   the scene, from another seed, is stored in the file, so a collision on the name is caught too.
+// - Written to a temporary file and renamed, so a crash mid-write leaves no partial file
+// - SBVH builds aren't cached: their clipped references depend on the objects' shapes within their
+//   boxes, which the hash doesn't see
+
+struct bvh_cache_header {
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t scene_hash;
+    std::uint64_t scene_check;      // bvh_scene_hash with bvh_cache_check_seed
+    std::uint64_t object_count;
+    std::uint64_t node_count;
+    std::uint64_t reference_count;  // Leaf entries; one per object unless a builder splits references
+};
+
+struct bvh_cache_node {
+    // Build tree nodes in depth-first order, each inner node followed by its first child
+    float bounds[6];            // Min x, y, z, then max x, y, z
+    std::uint32_t offset;       // Leaf: first reference; inner node: second child
+    std::uint32_t count;        // Leaf: reference count; 0 for an inner node
+    std::int32_t axis;
+    std::uint32_t pad;
+};
+
+const std::uint32_t bvh_cache_version = 2;
+
+// FNV-1a offset bases: the standard one for file names, another for the check stored in the file
+const std::uint64_t bvh_cache_name_seed = 0xcbf29ce484222325ull;
+const std::uint64_t bvh_cache_check_seed = 0x84222325cbf29ce4ull;
+
+// Builds over fewer objects are quicker to redo than to look up
+const size_t bvh_cache_min_objects = 256;
+
+inline std::uint64_t bvh_scene_hash(const std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end,
+                                    const bvh_options& options, std::uint64_t seed = bvh_cache_name_seed) {
+    // 64-bit FNV-1a over the build settings and the objects' boxes
+    std::uint64_t hash = seed;
+    auto mix = [&hash](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ull;
+        }
+    };
+
+    std::int32_t settings[] = {std::int32_t(bvh_cache_version), std::int32_t(options.split), options.sah_bins,
+                               options.morton_bits, options.max_leaf_size, options.treelet_passes,
+                               options.treelet_leaves};
+    mix(settings, sizeof(settings));
+    mix(&options.traversal_cost, sizeof(options.traversal_cost));
+
+    for (size_t i = start; i < end; i++) {
+        aabb box = objects[i]->bounding_box();
+        float bounds[6] = {box.x.min, box.y.min, box.z.min, box.x.max, box.y.max, box.z.max};
+        mix(bounds, sizeof(bounds));
+    }
+    return hash;
+}
+
+inline std::string bvh_cache_path(const std::string& dir, std::uint64_t scene_hash) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "bvh_%016llx.bin", (unsigned long long)scene_hash);
+    return dir + "/" + name;
+}
+
+inline void bvh_cache_flatten(const bvh_build_node& build_node, std::vector<bvh_cache_node>& nodes) {
+    size_t index = nodes.size();
+    nodes.push_back(bvh_cache_node());
+    for (int axis = 0; axis < 3; axis++) {
+        nodes[index].bounds[axis] = build_node.bbox.axis_interval(axis).min;
+        nodes[index].bounds[axis + 3] = build_node.bbox.axis_interval(axis).max;
+    }
+    nodes[index].axis = build_node.axis;
+    nodes[index].pad = 0;
+
+    if (build_node.is_leaf()) {
+        nodes[index].offset = build_node.first;
+        nodes[index].count = build_node.count;
+    } else {
+        bvh_cache_flatten(*build_node.children[0], nodes);
+        nodes[index].offset = nodes.size();
+        nodes[index].count = 0;
+        bvh_cache_flatten(*build_node.children[1], nodes);
+    }
+}
+
+inline bool save_bvh_cache(const std::string& path, std::uint64_t scene_hash, std::uint64_t scene_check,
+                           size_t start, size_t end, const bvh_build_result& built) {
+    std::vector<bvh_cache_node> nodes;
+    nodes.reserve(built.node_count);
+    bvh_cache_flatten(*built.root, nodes);
+
+    std::vector<std::uint32_t> references;
+    references.reserve(built.leaf_indices.size());
+    for (size_t index : built.leaf_indices)
+        references.push_back(index - start);
+
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(tmp_path, std::ios::binary);
+        bvh_cache_header header = {{'R','T','B','V'}, bvh_cache_version, scene_hash, scene_check, end - start,
+                                   nodes.size(), references.size()};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(bvh_cache_node));
+        out.write(reinterpret_cast<const char*>(references.data()), references.size() * sizeof(std::uint32_t));
+        if (!out) {
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+    }
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+inline std::unique_ptr<bvh_build_node> bvh_cache_unflatten(const bvh_cache_node* nodes, size_t node_count,
+                                                           size_t reference_count, size_t index, int depth) {
+    // Rebuilds the subtree at index, or returns null if the nodes don't form a valid tree
+    if (index >= node_count || depth >= bvh_max_depth)
+        return nullptr;
+
+    const bvh_cache_node& cached = nodes[index];
+    if (cached.axis < 0 || cached.axis > 2)
+        return nullptr;
+
+    // The boxes are set as stored, without the padding the aabb constructors add
+    std::unique_ptr<bvh_build_node> node(new bvh_build_node());
+    node->bbox.x = interval(cached.bounds[0], cached.bounds[3]);
+    node->bbox.y = interval(cached.bounds[1], cached.bounds[4]);
+    node->bbox.z = interval(cached.bounds[2], cached.bounds[5]);
+    node->axis = cached.axis;
+
+    if (cached.count > 0) {
+        if (size_t(cached.offset) + cached.count > reference_count)
+            return nullptr;
+        node->first = cached.offset;
+        node->count = cached.count;
+        return node;
+    }
+
+    // Children come after their parent, which also rules out cycles
+    if (cached.offset <= index + 1)
+        return nullptr;
+    node->children[0] = bvh_cache_unflatten(nodes, node_count, reference_count, index + 1, depth + 1);
+    node->children[1] = bvh_cache_unflatten(nodes, node_count, reference_count, cached.offset, depth + 1);
+    if (!node->children[0] || !node->children[1])
+        return nullptr;
+    return node;
+}
+
+inline bool load_bvh_cache(const std::string& path, std::uint64_t scene_hash, std::uint64_t scene_check,
+                           const std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end,
+                           bvh_build_result& result) {
+    // Returns false if the file is missing or doesn't hold a valid tree over objects[start, end)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(bvh_cache_header)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    const char* bytes = static_cast<const char*>(data);
+    const bvh_cache_header& header = *reinterpret_cast<const bvh_cache_header*>(bytes);
+    bool valid = std::string(header.magic, 4) == "RTBV" && header.version == bvh_cache_version
+              && header.scene_hash == scene_hash && header.scene_check == scene_check
+              && header.object_count == end - start
+              && header.node_count > 0 && header.node_count < size && header.reference_count < size
+              && size == sizeof(bvh_cache_header) + header.node_count * sizeof(bvh_cache_node)
+                                                  + header.reference_count * sizeof(std::uint32_t);
+
+    if (valid) {
+        const bvh_cache_node* nodes = reinterpret_cast<const bvh_cache_node*>(bytes + sizeof(bvh_cache_header));
+        const std::uint32_t* references = reinterpret_cast<const std::uint32_t*>(nodes + header.node_count);
+
+        result.root = bvh_cache_unflatten(nodes, header.node_count, header.reference_count, 0, 0);
+        result.node_count = header.node_count;
+        result.leaf_objects.clear();
+        result.leaf_indices.clear();
+        for (size_t i = 0; valid && i < header.reference_count; i++) {
+            valid = references[i] < end - start;
+            if (valid) {
+                result.leaf_indices.push_back(start + references[i]);
+                result.leaf_objects.push_back(objects[start + references[i]]);
+            }
+        }
+        valid = valid && result.root;
+    }
+
+    munmap(data, size);
+    return valid;
+}
+
+inline bvh_build_result load_or_build_bvh(const std::vector<std::shared_ptr<hittable>>& objects, size_t start,
+                                          size_t end, const bvh_options& options, bool use_cache = true) {
+    // build_bvh, going through the cache in options.cache_dir if one is set and use_cache is true.
+    // Rebuilds after a refit pass false: moved objects hash to a file no run would look up again.
+    if (!use_cache || options.cache_dir.empty() || end - start < bvh_cache_min_objects
+        || options.split == bvh_split::sbvh)
+        return build_bvh(objects, start, end, options);
+
+    std::uint64_t scene_hash = bvh_scene_hash(objects, start, end, options);
+    std::uint64_t scene_check = bvh_scene_hash(objects, start, end, options, bvh_cache_check_seed);
+    std::string path = bvh_cache_path(options.cache_dir, scene_hash);
+    bvh_build_result result;
+    if (load_bvh_cache(path, scene_hash, scene_check, objects, start, end, result)) {
+        std::clog << "Loaded BVH over " << end - start << " objects from " << path << std::endl;
+        return result;
+    }
+
+    result = build_bvh(objects, start, end, options);
+    mkdir(options.cache_dir.c_str(), 0755);
+    if (!save_bvh_cache(path, scene_hash, scene_check, start, end, result))
+        std::clog << "Failed to write BVH cache " << path << std::endl;
+    return result;
+}
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef BVH_MOTION_H
+#define BVH_MOTION_H
+
+#include "aabb.h"
+#include "bvh_build.h"
+#include "bvh_cache.h"
+#include "bvh_stats.h"
+#include "bvh_wide.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <cstdint>
+#include <vector>
+
+struct bvh_motion_node {
+    // A bvh_linear_node with bounds at both ends of the shutter interval
+    float bounds[2][6];     // At times 0 and 1; rows as in wide_bvh_node: min x, y, z, then max x, y, z
+    std::int32_t offset;    // Leaf: first object; interior node: second child (the first follows the node)
+    std::uint16_t count;    // Objects in a leaf, 0 for an interior node
+    std::uint8_t axis;      // Split axis of an interior node
+    std::uint8_t pad;
+
+    aabb box(float time) const {
+        // Bounds blended to time. The blend contains every object whose own bounds blend the same way,
+        // since each end's min (max) is at most (least) the objects' own.
+        aabb blended;
+        blended.x = interval(blend(0, time), blend(3, time));
+        blended.y = interval(blend(1, time), blend(4, time));
+        blended.z = interval(blend(2, time), blend(5, time));
+        return blended;
+    }
+
+    void set_box(int end, const aabb& box) {
+        for (int axis = 0; axis < 3; axis++) {
+            bounds[end][axis] = box.axis_interval(axis).min;
+            bounds[end][axis + 3] = box.axis_interval(axis).max;
+        }
+    }
+
+    float mean_area() const {
+        // Surface area averaged over the shutter interval. It is quadratic in time, so Simpson's rule
+        // over both ends and the middle is exact.
+        return (box(0).surface_area() + 4 * box(0.5f).surface_area() + box(1).surface_area()) / 6;
+    }
+
+    bool hit(const wide_ray& wr, float time, interval ray_t) const {
+        // Slab test against the bounds blended to time
+        for (int axis = 0; axis < 3; axis++) {
+            float t_near = (blend(wr.near[axis], time) - wr.origin[axis]) * wr.inv_dir[axis];
+            float t_far  = (blend(wr.far[axis], time) - wr.origin[axis]) * wr.inv_dir[axis];
+            // Comparisons are false for NaN (a ray in a slab's plane), leaving the interval unchanged
+            if (t_near > ray_t.min) ray_t.min = t_near;
+            if (t_far < ray_t.max) ray_t.max = t_far;
+        }
+        return ray_t.min <= ray_t.max;
+    }
+
+    float blend(int row, float time) const {
+        return bounds[0][row] + (bounds[1][row] - bounds[0][row]) * time;
+    }
+};
+
+class motion_bvh : public hittable {
+    // BVH for scenes with objects that move during the shutter interval (e.g., moving spheres)
+    // - A moving object's bounding box covers its whole path, so in an ordinary BVH every ray, at
+    //   whatever time, tests boxes as large as the paths. Here nodes store bounds at times 0 and 1
+    //   (from hittable::bounding_box_at), blended at each ray's time, so a ray only enters boxes
+    //   around where the objects are at that time. Static objects have the same bounds at both ends.
+    // - The tree is built over the objects' whole-path boxes. With both static and moving objects,
+    //   the static and moving ones are also built as two separate subtrees of the root, so static
+    //   geometry isn't grouped with objects moving through it, and whichever tree has the lower SAH
+    //   cost is kept. Separate subtrees win when the moving objects are few or localized; where they
+    //   are mixed in with static ones (as in bouncing_spheres), rays pay for traversing both
+    //   subtrees through the same space, and the combined tree wins.
+    // - Binary nodes only; options.width and options.quantized don't apply
+    public:
+        motion_bvh(hittable_list list, const bvh_options& options = default_bvh_options())
+         : objects(list.objects), options(options)
+        {
+            build();
+        }
+
+        static bool is_moving(const hittable& object) {
+            aabb start = object.bounding_box_at(0), end = object.bounding_box_at(1);
+            for (int axis = 0; axis < 3; axis++) {
+                if (start.axis_interval(axis).min != end.axis_interval(axis).min
+                 || start.axis_interval(axis).max != end.axis_interval(axis).max)
+                    return true;
+            }
+            return false;
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (nodes.empty())
+                return false;
+
+            // As in bvh_node::hit, with each node's bounds blended to the ray's time
+            float time = r.time();
+            wide_ray wr(r);
+            bool dir_is_negative[3] = {r.direction().x < 0, r.direction().y < 0, r.direction().z < 0};
+            int stack[bvh_max_depth];
+            int stack_size = 0;
+            int node_index = 0;
+            int visited = 0;
+            bool hit_anything = false;
+
+            while (true) {
+                const bvh_motion_node& node = nodes[node_index];
+                visited++;
+                if (node.hit(wr, time, ray_t)) {
+                    if (node.count == 0) {
+                        if (ordered && dir_is_negative[node.axis]) {
+                            stack[stack_size++] = node_index + 1;
+                            node_index = node.offset;
+                        } else {
+                            stack[stack_size++] = node.offset;
+                            node_index++;
+                        }
+                        continue;
+                    }
+
+                    for (int i = node.offset; i < node.offset + node.count; i++) {
+                        if (leaf_objects[i]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                }
+
+                if (stack_size == 0)
+                    break;
+                node_index = stack[--stack_size];
+            }
+
+            bvh_counters.queries++;
+            bvh_counters.nodes_visited += visited;
+            return hit_anything;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        bool refit() {
+            // As bvh_node::refit, blending both ends' boxes bottom-up from the objects' current bounds
+            if (nodes.empty())
+                return false;
+
+            fit_boxes(0);
+            bbox = aabb(nodes[0].box(0), nodes[0].box(1));
+
+            if (refit_cost() <= built_cost * (1 + options.refit_rebuild_threshold))
+                return false;
+            build(false);
+            return true;
+        }
+
+        float sah_cost() const {
+            // As bvh_node::sah_cost, with each box's area averaged over the shutter interval
+            if (nodes.empty())
+                return 0;
+            float cost = 0;
+            for (const auto& node : nodes)
+                cost += node.mean_area() * (node.count == 0 ? options.traversal_cost : node.count);
+            return cost / nodes[0].mean_area();
+        }
+
+        size_t memory_bytes() const {
+            return bvh_memory_bytes(nodes, leaf_objects);
+        }
+
+        bvh_stats stats() const {
+            // Boxes are taken at the middle of the shutter interval
+            bvh_stats stats("binary motion", nodes.size(), sah_cost(), memory_bytes());
+            stats.add_binary_tree(nodes, [](const bvh_motion_node& node) { return node.box(0.5f); });
+            stats.finish();
+            return stats;
+        }
+
+    private:
+        std::vector<bvh_motion_node> nodes;
+        std::vector<std::shared_ptr<hittable>> leaf_objects;
+        std::vector<std::shared_ptr<hittable>> objects;     // As given
+        bvh_options options;
+        aabb bbox;
+        bool ordered;
+        float built_cost;
+
+        void build(bool use_cache = true) {
+            nodes.clear();
+            leaf_objects.clear();
+            ordered = options.ordered_traversal;
+            bbox = aabb::empty;
+            if (objects.empty())
+                return;
+
+            std::vector<std::shared_ptr<hittable>> still, moving;
+            for (const auto& object : objects)
+                (is_moving(*object) ? moving : still).push_back(object);
+
+            add_subtree(objects, use_cache);
+            if (!still.empty() && !moving.empty()) {
+                std::vector<bvh_motion_node> combined_nodes;
+                std::vector<std::shared_ptr<hittable>> combined_leaf_objects;
+                float combined_cost = sah_cost();
+                nodes.swap(combined_nodes);
+                leaf_objects.swap(combined_leaf_objects);
+
+                nodes.push_back(bvh_motion_node());
+                add_subtree(still, use_cache);
+                int second = add_subtree(moving, use_cache);
+                for (int end = 0; end < 2; end++)
+                    nodes[0].set_box(end, aabb(nodes[1].box(end), nodes[second].box(end)));
+                nodes[0].offset = second;
+                nodes[0].count = 0;
+                nodes[0].axis = 0;
+                nodes[0].pad = 0;
+
+                if (sah_cost() >= combined_cost) {
+                    nodes.swap(combined_nodes);
+                    leaf_objects.swap(combined_leaf_objects);
+                }
+            }
+
+            // The blend stays between the two ends
+            bbox = aabb(nodes[0].box(0), nodes[0].box(1));
+            built_cost = refit_cost();
+            if (options.report_stats)
+                stats().print(std::clog);
+        }
+
+        float refit_cost() const {
+            return nodes.empty() ? 0 : bvh_refit_cost(sah_cost(), nodes[0].mean_area(), leaf_objects);
+        }
+
+        int add_subtree(const std::vector<std::shared_ptr<hittable>>& subtree_objects, bool use_cache) {
+            // Builds a tree over subtree_objects after the current nodes, and returns its root's index
+            bvh_build_result built = load_or_build_bvh(subtree_objects, 0, subtree_objects.size(), options, use_cache);
+            int root = nodes.size();
+            int first_object = leaf_objects.size();
+            leaf_objects.insert(leaf_objects.end(), built.leaf_objects.begin(), built.leaf_objects.end());
+            nodes.reserve(nodes.size() + built.node_count);
+            flatten(*built.root, first_object);
+            fit_boxes(root);
+            return root;
+        }
+
+        void fit_boxes(int first) {
+            // Sets both ends' boxes of the nodes from first on, from the objects' bounds at each end.
+            // Children are stored after their parent, so a reverse sweep visits them first.
+            for (int i = int(nodes.size()) - 1; i >= first; i--) {
+                bvh_motion_node& node = nodes[i];
+                for (int end = 0; end < 2; end++) {
+                    if (node.count == 0) {
+                        node.set_box(end, aabb(nodes[i + 1].box(end), nodes[node.offset].box(end)));
+                        continue;
+                    }
+                    aabb box = aabb::empty;
+                    for (int k = node.offset; k < node.offset + node.count; k++)
+                        box = aabb(box, leaf_objects[k]->bounding_box_at(end));
+                    node.set_box(end, box);
+                }
+            }
+        }
+
+        int flatten(const bvh_build_node& build_node, int first_object) {
+            int index = nodes.size();
+            nodes.push_back(bvh_motion_node());
+            nodes[index].axis = build_node.axis;
+            nodes[index].pad = 0;
+
+            if (build_node.is_leaf()) {
+                nodes[index].offset = first_object + build_node.first;
+                nodes[index].count = build_node.count;
+            } else {
+                flatten(*build_node.children[0], first_object);
+                int second = flatten(*build_node.children[1], first_object);
+                nodes[index].offset = second;
+                nodes[index].count = 0;
+            }
+
+            return index;
+        }
+};
+
+#endif
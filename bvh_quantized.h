@@ -0,0 +1,122 @@
+#ifndef BVH_QUANTIZED_H
+#define BVH_QUANTIZED_H
+
+#include "aabb.h"
+#include "bvh_wide.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+template <int N>
+struct alignas(64) quantized_bvh_node {
+    // Wide node whose child boxes are stored as 8-bit coordinates on a grid spanning the node's own
+    // box: 60 bytes for 4 children, against 116 for a wide_bvh_node<4>. Padded to 64 and allocated
+    // at that alignment (see aligned_allocator), a 4-wide node is exactly one cache line.
+    // - Grid steps are powers of two per axis, so decoding a coordinate is exact up to the final add
+    // - Mins round down and maxes round up, checked against the decoded value, so the decoded boxes
+    //   always contain the exact ones and no hit is missed; rays enter slightly more boxes instead
+    float origin[3];                // Min corner of the node's box
+    std::int8_t exponent[3];        // Grid step on each axis is 2^exponent
+    std::uint8_t pad;
+    std::uint8_t bounds[6][N];      // Rows: min x, y, z, then max x, y, z, in grid steps from origin
+    std::int32_t child[N];          // As in wide_bvh_node
+    std::uint8_t count[N];
+
+    void set_bounds(const aabb* boxes, int used) {
+        aabb node_box = aabb::empty;
+        for (int j = 0; j < used; j++)
+            node_box = aabb(node_box, boxes[j]);
+
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& extent = node_box.axis_interval(axis);
+            origin[axis] = extent.min;
+
+            // The smallest step whose 255 multiples reach across the box
+            int e;
+            std::frexp(extent.size() / 255, &e);
+            while (origin[axis] + 255 * std::ldexp(1.0f, e) < extent.max)
+                e++;
+            exponent[axis] = e;
+        }
+        pad = 0;
+
+        for (int j = 0; j < N; j++) {
+            for (int axis = 0; axis < 3; axis++) {
+                if (j >= used) {
+                    // Inverted boxes (min above max), which every ray misses
+                    bounds[axis][j] = 255;
+                    bounds[axis + 3][j] = 0;
+                    continue;
+                }
+                bounds[axis][j] = quantize_down(axis, boxes[j].axis_interval(axis).min);
+                bounds[axis + 3][j] = quantize_up(axis, boxes[j].axis_interval(axis).max);
+            }
+        }
+    }
+
+    const float (&child_bounds(float (&scratch)[6][N]) const)[6][N] {
+        for (int row = 0; row < 6; row++) {
+            int axis = row % 3;
+            float step = scale(axis);
+#if defined(BVH_WIDE_SSE)
+            // Four bytes at a time: widen to 32-bit integers, convert, scale and offset
+            __m128 offset = _mm_set1_ps(origin[axis]);
+            __m128 steps = _mm_set1_ps(step);
+            __m128i zero = _mm_setzero_si128();
+            for (int lane = 0; lane < N; lane += 4) {
+                std::int32_t packed;
+                std::memcpy(&packed, &bounds[row][lane], sizeof(packed));
+                __m128i bytes = _mm_cvtsi32_si128(packed);
+                __m128i words = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero);
+                __m128 decoded = _mm_add_ps(offset, _mm_mul_ps(_mm_cvtepi32_ps(words), steps));
+                _mm_storeu_ps(&scratch[row][lane], decoded);
+            }
+#else
+            for (int j = 0; j < N; j++)
+                scratch[row][j] = origin[axis] + bounds[row][j] * step;
+#endif
+        }
+        return scratch;
+    }
+
+    aabb child_box(int j) const {
+        return aabb(interval(decode(0, bounds[0][j]), decode(0, bounds[3][j])),
+                    interval(decode(1, bounds[1][j]), decode(1, bounds[4][j])),
+                    interval(decode(2, bounds[2][j]), decode(2, bounds[5][j])));
+    }
+
+    private:
+        float scale(int axis) const {
+            // 2^exponent, built from its float bits
+            std::uint32_t bits = std::uint32_t(exponent[axis] + 127) << 23;
+            float step;
+            std::memcpy(&step, &bits, sizeof(step));
+            return step;
+        }
+
+        float decode(int axis, int q) const {
+            return origin[axis] + q * scale(axis);
+        }
+
+        std::uint8_t quantize_down(int axis, float x) const {
+            int q = std::min(std::max(int(std::floor((x - origin[axis]) / scale(axis))), 0), 255);
+            while (q > 0 && decode(axis, q) > x)
+                q--;
+            return q;
+        }
+
+        std::uint8_t quantize_up(int axis, float x) const {
+            int q = std::min(std::max(int(std::ceil((x - origin[axis]) / scale(axis))), 0), 255);
+            while (q < 255 && decode(axis, q) < x)
+                q++;
+            return q;
+        }
+};
+
+static_assert(sizeof(quantized_bvh_node<4>) == 64, "quantized_bvh_node<4> should fill a cache line");
+
+typedef wide_bvh<4, quantized_bvh_node<4>> bvh4_quantized;
+typedef wide_bvh<8, quantized_bvh_node<8>> bvh8_quantized;
+
+#endif
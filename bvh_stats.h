@@ -0,0 +1,118 @@
+#ifndef BVH_STATS_H
+#define BVH_STATS_H
+
+#include "aabb.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct bvh_stats {
+    // Shape and quality of a built BVH, for comparing builders and catching regressions when scenes
+    // change (see the stats() member of each BVH layout)
+    // - Depths count from the root at 0; a wide node's leaf children are one below it
+    // - Sibling overlap is the surface area shared by each pair of children of a node, summed over the
+    //   tree and relative to the summed area of the nodes: 0 for disjoint siblings. Rays in shared
+    //   space enter more than one child.
+    std::string layout;
+    size_t node_count = 0;
+    size_t leaf_count = 0;
+    size_t object_references = 0;           // Summed over the leaves; above the object count if split
+    int max_depth = 0;
+    double mean_depth = 0;                  // Of the leaves
+    std::vector<size_t> leaf_histogram;     // Leaves by object count
+    float sah_cost = 0;
+    float sibling_overlap = 0;
+    size_t memory_bytes = 0;
+
+    bvh_stats(const std::string& layout, size_t node_count, float sah_cost, size_t memory_bytes)
+     : layout(layout), node_count(node_count), sah_cost(sah_cost), memory_bytes(memory_bytes) {}
+
+    template <typename Node, typename BoxOf>
+    void add_binary_tree(const std::vector<Node>& nodes, BoxOf box_of) {
+        // Adds the leaves and siblings of a flattened binary tree (bvh_node's layout: each inner node
+        // followed by its first child, with offset at the second), with box_of(node) giving each box
+        std::vector<std::pair<int, int>> stack;     // Node index and depth
+        if (!nodes.empty())
+            stack.push_back(std::make_pair(0, 0));
+        while (!stack.empty()) {
+            int index = stack.back().first, depth = stack.back().second;
+            stack.pop_back();
+            const Node& node = nodes[index];
+            if (node.count > 0) {
+                add_leaf(depth, node.count);
+                continue;
+            }
+            aabb children[2] = {box_of(nodes[index + 1]), box_of(nodes[node.offset])};
+            add_siblings(box_of(node), children, 2);
+            stack.push_back(std::make_pair(index + 1, depth + 1));
+            stack.push_back(std::make_pair(int(node.offset), depth + 1));
+        }
+    }
+
+    void add_leaf(int depth, int objects) {
+        leaf_count++;
+        object_references += objects;
+        max_depth = std::max(max_depth, depth);
+        depth_sum += depth;
+        if (leaf_histogram.size() <= size_t(objects))
+            leaf_histogram.resize(objects + 1);
+        leaf_histogram[objects]++;
+    }
+
+    void add_siblings(const aabb& parent, const aabb* children, int count) {
+        parent_area += parent.surface_area();
+        for (int i = 0; i < count; i++)
+            for (int j = i + 1; j < count; j++)
+                overlap_area += shared_area(children[i], children[j]);
+    }
+
+    void finish() {
+        mean_depth = leaf_count ? depth_sum / leaf_count : 0;
+        sibling_overlap = parent_area > 0 ? overlap_area / parent_area : 0;
+    }
+
+    void print(std::ostream& stream) const {
+        std::ostringstream out;
+        out << "BVH stats (" << layout << "): " << node_count << " nodes, " << leaf_count << " leaves, "
+            << object_references << " object references\n"
+            << "  depth: max " << max_depth << ", mean " << std::fixed << std::setprecision(2) << mean_depth << "\n"
+            << "  leaves by object count:";
+        for (size_t objects = 0; objects < leaf_histogram.size(); objects++) {
+            if (leaf_histogram[objects] > 0)
+                out << " " << objects << ": " << leaf_histogram[objects];
+        }
+        out << "\n  SAH cost " << std::setprecision(3) << sah_cost << ", sibling overlap " << sibling_overlap
+            << ", memory " << std::setprecision(1) << memory_bytes / 1024.0 << " KiB\n";
+        stream << out.str() << std::flush;
+    }
+
+    // Running sums, for finish()
+    double depth_sum = 0;
+    double parent_area = 0;
+    double overlap_area = 0;
+
+    static float shared_area(const aabb& a, const aabb& b) {
+        float size[3];
+        for (int axis = 0; axis < 3; axis++) {
+            const interval& ia = a.axis_interval(axis);
+            const interval& ib = b.axis_interval(axis);
+            size[axis] = std::min(ia.max, ib.max) - std::max(ia.min, ib.min);
+            if (size[axis] < 0)
+                return 0;
+        }
+        return 2 * (size[0]*size[1] + size[1]*size[2] + size[2]*size[0]);
+    }
+};
+
+template <typename Node, typename Allocator>
+size_t bvh_memory_bytes(const std::vector<Node, Allocator>& nodes, const std::vector<std::shared_ptr<hittable>>& leaf_objects) {
+    // Nodes plus the leaf object pointers (not the objects, which the scene owns)
+    return nodes.size() * sizeof(Node) + leaf_objects.size() * sizeof(std::shared_ptr<hittable>);
+}
+
+#endif
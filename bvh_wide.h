@@ -0,0 +1,429 @@
+#ifndef BVH_WIDE_H
+#define BVH_WIDE_H
+
+#include "aabb.h"
+#include "bvh_build.h"
+#include "bvh_cache.h"
+#include "bvh_stats.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define BVH_WIDE_SSE
+#endif
+
+template <int N>
+struct wide_bvh_node {
+    // Child boxes as structure-of-arrays, so a ray is tested against all of them at once
+    float bounds[6][N];         // Rows: min x, y, z, then max x, y, z
+    std::int32_t child[N];      // Inner child: node index; leaf: first object
+    std::uint8_t count[N];      // Leaf: object count; 0 for an inner child or an empty slot
+
+    void set_bounds(const aabb* boxes, int used) {
+        // Child boxes of slots [0, used); the rest get inverted boxes (min +inf, max -inf), which every
+        // ray misses
+        for (int j = 0; j < N; j++) {
+            for (int axis = 0; axis < 3; axis++) {
+                bounds[axis][j] = (j < used) ? boxes[j].axis_interval(axis).min : infinity;
+                bounds[axis + 3][j] = (j < used) ? boxes[j].axis_interval(axis).max : -infinity;
+            }
+        }
+    }
+
+    const float (&child_bounds(float (&)[6][N]) const)[6][N] {
+        // Bounds for the ray test; node formats that store them differently decode into the scratch array
+        return bounds;
+    }
+
+    aabb child_box(int j) const {
+        return aabb(interval(bounds[0][j], bounds[3][j]), interval(bounds[1][j], bounds[4][j]),
+                    interval(bounds[2][j], bounds[5][j]));
+    }
+};
+
+struct wide_ray {
+    // What every box test needs from a ray
+    float origin[3];
+    float inv_dir[3];
+    int near[3], far[3];    // Bounds rows holding the entry and exit plane of each axis
+
+    wide_ray(const ray& r) {
+        for (int axis = 0; axis < 3; axis++) {
+            origin[axis] = r.origin()[axis];
+            inv_dir[axis] = 1.0f / r.direction()[axis];
+            // Test the sign of the inverse, so -0 directions pick the planes that make the slab math work
+            bool negative = inv_dir[axis] < 0;
+            near[axis] = negative ? axis + 3 : axis;
+            far[axis]  = negative ? axis : axis + 3;
+        }
+    }
+};
+
+template <typename T>
+struct aligned_allocator {
+    // Allocates at T's alignment, which std::allocator ignores for over-aligned types before C++17
+    typedef T value_type;
+
+    aligned_allocator() {}
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U>&) {}
+
+    T* allocate(size_t n) {
+        void* p = nullptr;
+        if (posix_memalign(&p, std::max(alignof(T), sizeof(void*)), n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t) { std::free(p); }
+
+    template <typename U>
+    bool operator==(const aligned_allocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const aligned_allocator<U>&) const { return false; }
+};
+
+template <int N, typename Node = wide_bvh_node<N>>
+class wide_bvh : public hittable {
+    // N-ary BVH (N = 4 or 8) collapsed from the binary build: each node adopts the children of its
+    // largest inner children until it has N of them
+    // - Child boxes are tested with one SSE (4 lanes) or AVX (8 lanes) instruction sequence per slab;
+    //   without AVX an 8-wide node is tested as two SSE halves
+    // - Node is the storage format of a node's child boxes (wide_bvh_node, or quantized_bvh_node)
+    public:
+        wide_bvh(hittable_list list, const bvh_options& options = default_bvh_options())
+         : wide_bvh(list.objects, 0, list.objects.size(), options) {}
+
+        wide_bvh(std::vector<std::shared_ptr<hittable>>& objects, size_t start, size_t end,
+                 const bvh_options& options = default_bvh_options())
+         : objects(objects.begin() + start, objects.begin() + end), options(options)
+        {
+            build();
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            if (nodes.empty())
+                return false;
+
+            // Children are pushed farthest first, so the nearest is visited next, and carry their box
+            // entry distance so they are culled when popped if a closer hit has been found since
+            struct stack_entry {
+                std::int32_t child;
+                std::int32_t count;     // Leaf object count, 0 for a node
+                float t_entry;
+            };
+
+            wide_ray wr(r);
+            stack_entry stack[bvh_max_depth * N];
+            int stack_size = 0;
+            stack[stack_size++] = {0, 0, ray_t.min};
+            int visited = 0;
+            bool hit_anything = false;
+
+            while (stack_size > 0) {
+                stack_entry entry = stack[--stack_size];
+                if (entry.t_entry > ray_t.max)
+                    continue;
+
+                if (entry.count > 0) {
+                    for (int k = entry.child; k < entry.child + entry.count; k++) {
+                        if (leaf_objects[k]->hit(r, ray_t, rec)) {
+                            hit_anything = true;
+                            ray_t.max = rec.t;
+                        }
+                    }
+                    continue;
+                }
+
+                const Node& node = nodes[entry.child];
+                visited++;
+                float scratch[6][N];
+                float t_entry[N];
+                int mask = hit_mask(node.child_bounds(scratch), wr, ray_t.min, ray_t.max, t_entry);
+
+                // Hit children sorted nearest first (insertion sort; there are at most N)
+                int order[N];
+                int hits = 0;
+                for (int i = 0; i < N; i++) {
+                    if (!(mask & (1 << i)))
+                        continue;
+                    int k = hits++;
+                    for (; ordered && k > 0 && t_entry[order[k-1]] > t_entry[i]; k--)
+                        order[k] = order[k-1];
+                    order[k] = i;
+                }
+
+                for (int k = hits - 1; k >= 0; k--) {
+                    int i = order[k];
+                    stack[stack_size++] = {node.child[i], node.count[i], t_entry[i]};
+                }
+            }
+
+            bvh_counters.queries++;
+            bvh_counters.nodes_visited += visited;
+            return hit_anything;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        bool refit() {
+            // As bvh_node::refit: updates the child boxes bottom-up and rebuilds if the tree degraded
+            if (nodes.empty())
+                return false;
+
+            fit_boxes();
+            if (refit_cost() <= built_cost * (1 + options.refit_rebuild_threshold))
+                return false;
+            build(false);
+            return true;
+        }
+
+        float sah_cost() const {
+            // As bvh_node::sah_cost, with one traversal cost per wide node
+            if (nodes.empty())
+                return 0;
+            float cost = options.traversal_cost * bbox.surface_area();
+            for (const auto& node : nodes) {
+                for (int j = 0; j < N && !is_empty_slot(node, j); j++) {
+                    float area = node.child_box(j).surface_area();
+                    cost += area * (node.count[j] == 0 ? options.traversal_cost : node.count[j]);
+                }
+            }
+            return cost / bbox.surface_area();
+        }
+
+        size_t memory_bytes() const {
+            return bvh_memory_bytes(nodes, leaf_objects);
+        }
+
+        bvh_stats stats() const {
+            std::string layout = std::to_string(N) + "-wide" + (std::is_same<Node, wide_bvh_node<N>>::value ? "" : " quantized");
+            bvh_stats stats(layout, nodes.size(), sah_cost(), memory_bytes());
+
+            std::vector<std::pair<int, int>> stack;     // Node index and depth
+            if (!nodes.empty())
+                stack.push_back(std::make_pair(0, 0));
+            while (!stack.empty()) {
+                int index = stack.back().first, depth = stack.back().second;
+                stack.pop_back();
+                const Node& node = nodes[index];
+                aabb boxes[N], node_box = aabb::empty;
+                int used = 0;
+                for (; used < N && !is_empty_slot(node, used); used++) {
+                    boxes[used] = node.child_box(used);
+                    node_box = aabb(node_box, boxes[used]);
+                    if (node.count[used] > 0)
+                        stats.add_leaf(depth + 1, node.count[used]);
+                    else
+                        stack.push_back(std::make_pair(int(node.child[used]), depth + 1));
+                }
+                stats.add_siblings(node_box, boxes, used);
+            }
+            stats.finish();
+            return stats;
+        }
+
+    private:
+        std::vector<Node, aligned_allocator<Node>> nodes;
+        std::vector<std::shared_ptr<hittable>> leaf_objects;
+        std::vector<std::shared_ptr<hittable>> objects;     // As given, for rebuilds
+        bvh_options options;
+        aabb bbox;
+        bool ordered;
+        float built_cost;
+
+        void build(bool use_cache = true) {
+            bvh_build_result built = load_or_build_bvh(objects, 0, objects.size(), options, use_cache);
+            leaf_objects.swap(built.leaf_objects);
+            ordered = options.ordered_traversal;
+
+            bbox = built.root->bbox;
+            nodes.clear();
+            if (!leaf_objects.empty())
+                collapse(*built.root);
+            built_cost = unmoved_refit_cost();
+            if (options.report_stats)
+                stats().print(std::clog);
+        }
+
+        void fit_boxes() {
+            // As bvh_node::fit_boxes. Inner children are stored after their parent, so a reverse sweep
+            // visits them first. Exact node boxes are kept aside, as a node format may only store them
+            // rounded.
+            std::vector<aabb> node_boxes(nodes.size());
+            for (int i = int(nodes.size()) - 1; i >= 0; i--) {
+                Node& node = nodes[i];
+                aabb boxes[N];
+                int used = 0;
+                for (; used < N && !is_empty_slot(node, used); used++) {
+                    int j = used;
+                    if (node.count[j] == 0) {
+                        boxes[j] = node_boxes[node.child[j]];
+                        continue;
+                    }
+                    boxes[j] = aabb::empty;
+                    for (int k = node.child[j]; k < node.child[j] + node.count[j]; k++)
+                        boxes[j] = aabb(boxes[j], leaf_objects[k]->bounding_box());
+                }
+                node.set_bounds(boxes, used);
+
+                node_boxes[i] = aabb::empty;
+                for (int j = 0; j < used; j++)
+                    node_boxes[i] = aabb(node_boxes[i], boxes[j]);
+            }
+            bbox = node_boxes[0];
+        }
+
+        float unmoved_refit_cost() {
+            // As bvh_node::unmoved_refit_cost
+            if (nodes.empty())
+                return 0;
+            std::vector<Node, aligned_allocator<Node>> built_nodes = nodes;
+            aabb built_box = bbox;
+            fit_boxes();
+            float cost = refit_cost();
+            nodes.swap(built_nodes);
+            bbox = built_box;
+            return cost;
+        }
+
+        float refit_cost() const {
+            return nodes.empty() ? 0 : bvh_refit_cost(sah_cost(), bbox.surface_area(), leaf_objects);
+        }
+
+        static bool is_empty_slot(const Node& node, int j) {
+            // Slots fill from the front, and no node has the root as a child
+            return node.count[j] == 0 && node.child[j] == 0;
+        }
+
+        int collapse(const bvh_build_node& build_node) {
+            std::vector<const bvh_build_node*> children;
+            if (build_node.is_leaf()) {
+                children.push_back(&build_node);
+            } else {
+                children.push_back(build_node.children[0].get());
+                children.push_back(build_node.children[1].get());
+            }
+
+            // Open up the inner child with the largest surface area, which rays are most likely to enter,
+            // keeping its children next to each other
+            while (children.size() < size_t(N)) {
+                int largest = -1;
+                float largest_area = -1;
+                for (size_t i = 0; i < children.size(); i++) {
+                    float area = children[i]->bbox.surface_area();
+                    if (!children[i]->is_leaf() && area > largest_area) {
+                        largest = i;
+                        largest_area = area;
+                    }
+                }
+                if (largest < 0)
+                    break;
+
+                const bvh_build_node* opened = children[largest];
+                children[largest] = opened->children[0].get();
+                children.insert(children.begin() + largest + 1, opened->children[1].get());
+            }
+
+            int index = nodes.size();
+            nodes.push_back(Node());
+            aabb boxes[N];
+            for (int i = 0; i < N; i++) {
+                nodes[index].child[i] = 0;
+                nodes[index].count[i] = 0;
+            }
+
+            for (size_t i = 0; i < children.size(); i++) {
+                const bvh_build_node& c = *children[i];
+                boxes[i] = c.bbox;
+
+                if (c.is_leaf()) {
+                    nodes[index].child[i] = c.first;
+                    nodes[index].count[i] = c.count;
+                } else {
+                    int child_index = collapse(c);
+                    nodes[index].child[i] = child_index;
+                }
+            }
+            nodes[index].set_bounds(boxes, children.size());
+
+            return index;
+        }
+
+        static int hit_mask(const float (&bounds)[6][N], const wide_ray& wr, float t_min, float t_max, float* t_entry) {
+            // Bit i is set if the ray enters child i's box within [t_min, t_max], at t_entry[i]
+#if defined(__AVX__)
+            if (N == 8)
+                return hit_mask8(bounds, wr, t_min, t_max, t_entry);
+#endif
+#if defined(BVH_WIDE_SSE)
+            int mask = 0;
+            for (int lane = 0; lane < N; lane += 4)
+                mask |= hit_mask4(bounds, wr, lane, t_min, t_max, t_entry) << lane;
+            return mask;
+#else
+            int mask = 0;
+            for (int i = 0; i < N; i++) {
+                float t_near = t_min, t_far = t_max;
+                for (int axis = 0; axis < 3; axis++) {
+                    t_near = std::fmax(t_near, (bounds[wr.near[axis]][i] - wr.origin[axis]) * wr.inv_dir[axis]);
+                    t_far = std::fmin(t_far, (bounds[wr.far[axis]][i] - wr.origin[axis]) * wr.inv_dir[axis]);
+                }
+                t_entry[i] = t_near;
+                if (t_near < t_far)
+                    mask |= 1 << i;
+            }
+            return mask;
+#endif
+        }
+
+#if defined(BVH_WIDE_SSE)
+        static int hit_mask4(const float (&bounds)[6][N], const wide_ray& wr, int lane, float t_min, float t_max,
+                             float* t_entry) {
+            // min/max return their second operand when either is NaN (a ray parallel to and on a slab
+            // plane), so such slabs leave the interval unchanged, as std::fmin/fmax do
+            __m128 t_near = _mm_set1_ps(t_min);
+            __m128 t_far = _mm_set1_ps(t_max);
+            for (int axis = 0; axis < 3; axis++) {
+                __m128 origin = _mm_set1_ps(wr.origin[axis]);
+                __m128 inv_dir = _mm_set1_ps(wr.inv_dir[axis]);
+                __m128 near_plane = _mm_loadu_ps(&bounds[wr.near[axis]][lane]);
+                __m128 far_plane = _mm_loadu_ps(&bounds[wr.far[axis]][lane]);
+                t_near = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, origin), inv_dir), t_near);
+                t_far = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, origin), inv_dir), t_far);
+            }
+            _mm_storeu_ps(t_entry + lane, t_near);
+            return _mm_movemask_ps(_mm_cmplt_ps(t_near, t_far));
+        }
+#endif
+
+#if defined(__AVX__)
+        static int hit_mask8(const float (&bounds)[6][N], const wide_ray& wr, float t_min, float t_max, float* t_entry) {
+            __m256 t_near = _mm256_set1_ps(t_min);
+            __m256 t_far = _mm256_set1_ps(t_max);
+            for (int axis = 0; axis < 3; axis++) {
+                __m256 origin = _mm256_set1_ps(wr.origin[axis]);
+                __m256 inv_dir = _mm256_set1_ps(wr.inv_dir[axis]);
+                __m256 near_plane = _mm256_loadu_ps(&bounds[wr.near[axis]][0]);
+                __m256 far_plane = _mm256_loadu_ps(&bounds[wr.far[axis]][0]);
+                t_near = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near_plane, origin), inv_dir), t_near);
+                t_far = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, origin), inv_dir), t_far);
+            }
+            _mm256_storeu_ps(t_entry, t_near);
+            return _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LT_OQ));
+        }
+#endif
+};
+
+typedef wide_bvh<4> bvh4;
+typedef wide_bvh<8> bvh8;
+
+#endif
@@ -3,10 +3,21 @@
 
 #include "rtweekend.h"
 
+#include "checkpoint.h"
+#include "distributed.h"
+#include "framebuffer.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
 #include "pdf.h"
+#include "tile_scheduler.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 class camera {
     public:
@@ -26,35 +37,66 @@ class camera {
         float defocus_angle = 10.0;    // Cone angle, entire span
         float focus_dist    = 3.4;
 
-        void render(const hittable& world, const hittable& lights) {
-            auto t0 = std::chrono::steady_clock::now();
-            
-            initialize();
-            
-            // Render
-            std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-            for (int j = 0; j < image_height; j++) {
-                std::clog << "\rScanlines remaining: " << image_height-j-1 << ' ' << std::flush;
-                for (int i = 0; i < image_width; i++) {
-                    glm::vec3 pixel_color(0);
-                    // Perform antialiasing by taking multiple, slightly offset samples per pixel
-                    for (int sample = 0; sample < samples_per_pixel; sample++) {
-                        ray r = get_ray(i,j);  // aims at viewport
-                        pixel_color += ray_color(r, max_depth, world, lights);
-                    }
-                    write_color(std::cout, pixel_color * pixel_samples_scale);
-                }
-            }
-            std::clog << "\nDone!\n";
+        int num_threads   = 0;      // Render threads, 0 = hardware concurrency
+        int tile_size     = 64;     // Initial tile edge length in pixels
+        int min_tile_size = 8;      // Tiles are split down to this size to keep idle threads busy
+        tile_order tile_ordering = tile_order::spiral;
 
-            auto t1 = std::chrono::steady_clock::now();
-            std::chrono::duration<double, std::chrono::minutes::period> dur = t1 - t0;
-            std::clog << "Total render time: " << std::fixed << std::setprecision(3) << dur.count() << " min" << std::endl;
+        // Progressive rendering: samples are taken in passes of samples_per_pass and accumulated,
+        // and a snapshot of the image so far is written every snapshot_passes passes or
+        // snapshot_seconds seconds, whichever comes first
+        int samples_per_pass    = 0;    // 0 = all samples in one pass
+        int snapshot_passes     = 0;    // 0 = no pass-count snapshots
+        double snapshot_seconds = 0;    // 0 = no timed snapshots
+        std::string snapshot_path = "snapshot.ppm";
+
+        // Format of the final image on stdout and of snapshots
+        image_format output_format = image_format::ppm_binary;
+
+        // Adaptive sampling: a pixel stops taking samples once the relative standard error of its mean
+        // luminance drops below adaptive_threshold, making samples_per_pixel the maximum
+        float adaptive_threshold  = 0;      // 0 = every pixel takes samples_per_pixel samples
+        int min_samples_per_pixel = 16;
+
+        // Deadline-bounded rendering: passes keep being added until time_budget_seconds after the render
+        // started, with samples_per_pixel still capping the total. The pass in flight at the deadline is
+        // either finished or cut off once each thread completes the pixel it is on.
+        double time_budget_seconds   = 0;       // 0 = no deadline
+        bool finish_pass_at_deadline = false;
+
+        // Checkpointing: every checkpoint_passes passes or checkpoint_seconds seconds, and when stopped
+        // by the deadline, the render state is saved to checkpoint_path. A render that finds a matching
+        // checkpoint there resumes from it. Checkpoints fall between passes, so set samples_per_pass.
+        std::string checkpoint_path;            // Empty = no checkpoints
+        int checkpoint_passes     = 0;
+        double checkpoint_seconds = 0;
+
+        // Sharded rendering: shard shard_index of shard_count takes its own contiguous range of every
+        // pixel's sample indices and saves its framebuffer to shard_path instead of writing an image.
+        // merge_shards combines a complete set of shards into an image.
+        int shard_index = 0;
+        int shard_count = 1;
+        std::string shard_path = "shard.bin";
+
+        std::vector<tile_timing> tile_timings;  // Per-tile timing of the last render
+
+        // Distributed rendering: a coordinator leases tiles to worker processes that build the same
+        // scene. Both take a Unix socket path or host:port; distributed renders take a single pass.
+        std::string coordinator_address;    // Coordinate workers from here instead of rendering
+        std::string worker_address;         // Render tiles leased by the coordinator here
+        double lease_timeout_seconds = 600; // Lease a tile again if its worker hasn't returned it by then
+
+        void render(const hittable& world) {
+            // Without lights to steer towards, scattered rays sample the material's PDF alone
+            render_image(world, nullptr);
+        }
+
+        void render(const hittable& world, const hittable& lights) {
+            render_image(world, &lights);
         }
 
     private:
         int       image_height;
-        float     pixel_samples_scale;  // For antialiasing
         glm::vec3 camera_center;
         glm::vec3 pixel00_loc;
         glm::vec3 pixel_delta_u;
@@ -65,12 +107,18 @@ class camera {
         glm::vec3 defocus_disk_u;
         glm::vec3 defocus_disk_v;
 
+        std::chrono::steady_clock::time_point render_start;
+        std::chrono::steady_clock::time_point deadline;
+        int sample_begin = 0;   // First sample index this process renders
+
         void initialize() {
             // Image dimensions
             image_height = image_width / aspect_ratio;
             image_height = (image_height < 1) ? 1 : image_height;
 
-            pixel_samples_scale = 1.0f / samples_per_pixel;
+            if (num_threads <= 0)
+                num_threads = std::thread::hardware_concurrency();
+            num_threads = (num_threads < 1) ? 1 : num_threads;
 
             camera_center = lookfrom;
 
@@ -105,6 +153,245 @@ class camera {
             defocus_disk_v = v * defocus_radius;
         }
         
+        bool past_deadline() const {
+            return time_budget_seconds > 0 && std::chrono::steady_clock::now() >= deadline;
+        }
+
+        bool due(int pass, int every_passes, double every_seconds, std::chrono::steady_clock::time_point last) const {
+            // Whether a periodic action is due after the given pass
+            if (every_passes > 0 && (pass+1) % every_passes == 0)
+                return true;
+            return every_seconds > 0
+                && std::chrono::duration<double>(std::chrono::steady_clock::now() - last).count() >= every_seconds;
+        }
+
+        bool cut_off() const {
+            // Whether to abandon the rest of the current pass
+            return !finish_pass_at_deadline && past_deadline();
+        }
+
+        void write_output(const framebuffer& image) const {
+            // Write the image to stdout in one piece, reporting NaN pixels once rather than per pixel
+            int nan_pixels = write_image(std::cout, image_width, image_height, image.resolve(), output_format);
+            if (nan_pixels > 0)
+                std::clog << nan_pixels << " pixels had NaN components, written as 0" << std::endl;
+        }
+
+        void log_tile_timings() const {
+            // Tile cost spread and the tail: how long the first thread to run out of work sat idle
+            // while the last one finished
+            double total = 0, slowest = 0;
+            std::vector<double> worker_end(num_threads, 0.0);
+            for (const auto& timing : tile_timings) {
+                total += timing.seconds;
+                slowest = std::fmax(slowest, timing.seconds);
+                worker_end[timing.worker] = std::fmax(worker_end[timing.worker], timing.start + timing.seconds);
+            }
+            auto ends = std::minmax_element(worker_end.begin(), worker_end.end());
+
+            std::clog << "Tiles rendered: " << tile_timings.size()
+                      << ", mean " << 1000 * total / tile_timings.size() << " ms"
+                      << ", slowest " << 1000 * slowest << " ms"
+                      << ", thread finish spread " << 1000 * (*ends.second - *ends.first) << " ms" << std::endl;
+        }
+
+        void render_image(const hittable& world, const hittable* lights) {
+            render_start = std::chrono::steady_clock::now();
+            
+            initialize();
+            
+            framebuffer image(image_width, image_height);
+            tile full_image = {0, 0, image_width, image_height};
+            hello_message settings = {image_width, image_height, samples_per_pixel};
+
+            if (!worker_address.empty()) {
+                run_tile_worker(worker_address, settings, [&](const tile& region, framebuffer& tile_image) {
+                    render_pass(world, lights, region, 0, samples_per_pixel, tile_image);
+                });
+                return;
+            }
+
+            if (!coordinator_address.empty()) {
+                std::vector<tile> tiles = make_tiles(full_image, tile_size, tile_size, tile_ordering);
+                tile_coordinator coordinator(coordinator_address, settings, tiles, lease_timeout_seconds);
+                if (!coordinator.run(image))
+                    return;
+                std::clog << "\nDone!\n";
+                write_output(image);
+                return;
+            }
+
+            tile_timings.clear();
+
+            std::unique_ptr<snapshot_writer> snapshots;
+            if (snapshot_passes > 0 || snapshot_seconds > 0)
+                snapshots.reset(new snapshot_writer(snapshot_path, output_format));
+            auto last_snapshot = render_start;
+
+            // This process's share of each pixel's sample indices
+            sample_begin = int((long long)samples_per_pixel * shard_index / shard_count);
+            int sample_end = int((long long)samples_per_pixel * (shard_index+1) / shard_count);
+            int sample_range = sample_end - sample_begin;
+
+            // Under a deadline, default to single-sample passes so the image is always evenly sampled
+            int pass_samples = (samples_per_pass > 0) ? samples_per_pass
+                             : (time_budget_seconds > 0) ? 1 : sample_range;
+            deadline = render_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(time_budget_seconds));
+
+            checkpoint_info info = {samples_per_pixel, sample_begin, sample_end, pass_samples, 0};
+            int num_passes = info.num_passes();
+            if (!checkpoint_path.empty() && load_checkpoint(checkpoint_path, image, info))
+                std::clog << "Resuming from checkpoint " << checkpoint_path << " at pass " << info.next_pass+1 << " of " << num_passes << std::endl;
+            int pass = info.next_pass;
+            auto last_checkpoint = render_start;
+            bool complete = false;
+
+            for (; pass < num_passes && !past_deadline(); pass++) {
+                int first_sample = sample_begin + pass * pass_samples;
+                int end_sample = std::min(first_sample + pass_samples, sample_end);
+                render_pass(world, lights, full_image, first_sample, end_sample, image);
+
+                // A pass cut off at the deadline stays current, so a resumed render completes it
+                if (cut_off())
+                    break;
+                if (pass == num_passes-1) {
+                    complete = true;
+                    break;
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                if (!checkpoint_path.empty() && due(pass, checkpoint_passes, checkpoint_seconds, last_checkpoint)) {
+                    info.next_pass = pass+1;
+                    if (!save_checkpoint(checkpoint_path, image, info))
+                        std::clog << "\nFailed to write checkpoint " << checkpoint_path << std::endl;
+                    last_checkpoint = now;
+                }
+
+                // The writer thread formats and writes the snapshot while the next pass renders
+                if (snapshots && due(pass, snapshot_passes, snapshot_seconds, last_snapshot)) {
+                    snapshots->submit(image_width, image_height, image.resolve());
+                    last_snapshot = now;
+                }
+            }
+            info.next_pass = complete ? num_passes : pass;
+
+            // Keep a checkpoint to continue from if the render stopped early, otherwise it's done with
+            if (!checkpoint_path.empty()) {
+                if (complete)
+                    std::remove(checkpoint_path.c_str());
+                else if (!save_checkpoint(checkpoint_path, image, info))
+                    std::clog << "\nFailed to write checkpoint " << checkpoint_path << std::endl;
+            }
+            std::clog << "\nDone!\n";
+
+            if (time_budget_seconds > 0) {
+                auto counts = std::minmax_element(image.samples.begin(), image.samples.end());
+                std::clog << "Time budget: " << info.next_pass << " of " << num_passes << " passes completed, "
+                          << *counts.first << "-" << *counts.second << " samples per pixel" << std::endl;
+            }
+
+            if (adaptive_threshold > 0) {
+                long long fixed_samples = (long long)image_width * image_height * sample_range;
+                long long saved = fixed_samples - image.total_samples();
+                std::clog << "Adaptive sampling: " << image.total_samples() << " samples taken, " << saved
+                          << " (" << std::fixed << std::setprecision(1) << 100.0 * saved / fixed_samples
+                          << "%) saved against " << sample_range << " spp" << std::endl;
+            }
+
+            if (shard_count > 1) {
+                // The shard's framebuffer is its output; merge_shards makes the image
+                if (save_checkpoint(shard_path, image, info))
+                    std::clog << "Shard " << shard_index << "/" << shard_count << " (samples " << sample_begin
+                              << "-" << sample_end << ") written to " << shard_path << std::endl;
+                else
+                    std::clog << "Failed to write shard " << shard_path << std::endl;
+            } else {
+                write_output(image);
+            }
+
+            auto t1 = std::chrono::steady_clock::now();
+            std::chrono::duration<double, std::chrono::minutes::period> dur = t1 - render_start;
+            std::clog << "Total render time: " << std::fixed << std::setprecision(3) << dur.count() << " min" << std::endl;
+
+            log_tile_timings();
+        }
+
+        void render_pass(const hittable& world, const hittable* lights, const tile& region, int first_sample, int end_sample, framebuffer& image) {
+            // Render samples [first_sample, end_sample) of every pixel in region, with tiles distributed over the threads
+            std::vector<tile> tiles = make_tiles(region, tile_size, tile_size, tile_ordering);
+            tile_scheduler scheduler(num_threads, min_tile_size);
+            scheduler.seed(tiles);
+
+            std::vector<std::vector<tile_timing>> worker_timings(num_threads);
+            std::atomic<int> pixels_done(0);
+            std::mutex log_mutex;
+
+            auto worker = [&](int id) {
+                tile t;
+                while (!cut_off() && scheduler.next(id, t)) {
+                    auto tile_t0 = std::chrono::steady_clock::now();
+                    render_tile(t, world, lights, first_sample, end_sample, image);
+                    auto tile_t1 = std::chrono::steady_clock::now();
+                    worker_timings[id].push_back({t, id,
+                        std::chrono::duration<double>(tile_t0 - render_start).count(),
+                        std::chrono::duration<double>(tile_t1 - tile_t0).count()});
+
+                    int done = pixels_done += t.area();
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    std::clog << "\rSamples " << first_sample << "-" << end_sample << " of " << samples_per_pixel
+                              << ", pixels remaining: " << region.area() - done << ' ' << std::flush;
+                }
+            };
+
+            // Samples are keyed by pixel and sample index, so the image doesn't depend on the thread count
+            std::vector<std::thread> threads;
+            for (int i = 0; i < num_threads; i++)
+                threads.emplace_back(worker, i);
+            for (auto& thread : threads)
+                thread.join();
+
+            for (const auto& timings : worker_timings)
+                tile_timings.insert(tile_timings.end(), timings.begin(), timings.end());
+        }
+
+        void render_tile(const tile& t, const hittable& world, const hittable* lights, int first_sample, int end_sample, framebuffer& image) const {
+            for (int j = t.y0; j < t.y1; j++) {
+                for (int i = t.x0; i < t.x1; i++) {
+                    if (cut_off())
+                        return;
+
+                    int index = j*image_width + i;
+                    if (image.converged[index])
+                        continue;
+
+                    // Skip samples this pixel already has, from a pass that was cut off before a resume
+                    int begin_sample = std::max(first_sample, sample_begin + image.samples[index]);
+
+                    glm::vec3 pixel_color(0);
+                    int taken = 0;
+                    // Perform antialiasing by taking multiple, slightly offset samples per pixel
+                    for (int sample = begin_sample; sample < end_sample; sample++) {
+                        thread_sampler.start_sample(index, sample);
+                        ray r = get_ray(i,j);  // aims at viewport
+                        glm::vec3 sample_color = ray_color(r, max_depth, world, lights);
+                        pixel_color += sample_color;
+                        taken++;
+
+                        if (adaptive_threshold > 0) {
+                            running_variance& stats = image.stats[index];
+                            stats.add(luminance(sample_color));
+                            if (stats.n >= min_samples_per_pixel && stats.relative_error() < adaptive_threshold) {
+                                image.converged[index] = true;
+                                break;
+                            }
+                        }
+                    }
+                    image.add(index, pixel_color, taken);
+                }
+            }
+        }
+
         ray get_ray(int i, int j) const {
             // - From: Defocus disk surrounding camera_center
             // - To: Random point near pixel (i, j) (within (i,j)±(0.5,0.5))
@@ -132,7 +419,7 @@ class camera {
             return camera_center + p.x*defocus_disk_u + p.y*defocus_disk_v;
         }
         
-        glm::vec3 ray_color(const ray& r, int depth, const hittable& world, const hittable& lights) const {
+        glm::vec3 ray_color(const ray& r, int depth, const hittable& world, const hittable* lights) const {
             if (depth <= 0)
                 return glm::vec3(0,0,0);
             
@@ -157,13 +444,20 @@ class camera {
             if (srec.skip_pdf)
                 return srec.attenuation * ray_color(srec.skip_pdf_ray, depth-1, world, lights);
             
-            // Mix PDFs of lights (steer towards lights) and the material (surface properties)
-            std::shared_ptr<hittable_pdf> lights_pdf = std::make_shared<hittable_pdf>(lights, rec.p);
-            mixture_pdf mixed_pdf(lights_pdf, srec.pdf_ptr);
+            ray scattered;
+            double pdf_value;
+            if (lights) {
+                // Mix PDFs of lights (steer towards lights) and the material (surface properties)
+                std::shared_ptr<hittable_pdf> lights_pdf = std::make_shared<hittable_pdf>(*lights, rec.p);
+                mixture_pdf mixed_pdf(lights_pdf, srec.pdf_ptr);
                 
-            // Generate (sample) a ray based on the mixed PDF and compute its PDF value
-            ray scattered = ray(rec.p, mixed_pdf.generate(), r.time());
-            double pdf_value = mixed_pdf.value(scattered.direction());
+                // Generate (sample) a ray based on the mixed PDF and compute its PDF value
+                scattered = ray(rec.p, mixed_pdf.generate(), r.time());
+                pdf_value = mixed_pdf.value(scattered.direction());
+            } else {
+                scattered = ray(rec.p, srec.pdf_ptr->generate(), r.time());
+                pdf_value = srec.pdf_ptr->value(scattered.direction());
+            }
 
             // pScatter as defined by the material
             double scattering_pdf = rec.mat->scattering_pdf(r, rec, scattered);
@@ -0,0 +1,179 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Render state files: checkpoints and shard outputs
+// - Hold the framebuffer (accumulated radiance, per-pixel sample counts and adaptive sampling
+//   state), the range of sample indices being rendered and the pass to continue from
+// - Camera samples are keyed by (pixel, sample index), so a pixel's sample count is also its
+//   sampler stream position: a resumed render draws exactly the samples an uninterrupted one would
+// - Written to a temporary file and renamed, so a crash mid-write leaves the previous file
+
+struct checkpoint_info {
+    std::int32_t samples_per_pixel;
+    std::int32_t sample_begin, sample_end;  // Sample indices [begin, end) of each pixel being rendered
+    std::int32_t pass_samples;
+    std::int32_t next_pass;
+
+    int num_passes() const {
+        int sample_range = sample_end - sample_begin;
+        return (pass_samples > 0) ? (sample_range + pass_samples - 1) / pass_samples : 0;
+    }
+
+    bool same_render(const checkpoint_info& other) const {
+        return samples_per_pixel == other.samples_per_pixel && sample_begin == other.sample_begin
+            && sample_end == other.sample_end && pass_samples == other.pass_samples;
+    }
+};
+
+struct checkpoint_header {
+    char magic[4];
+    std::uint32_t version;
+    std::int32_t width, height;
+    checkpoint_info info;
+};
+
+const std::uint32_t checkpoint_version = 2;
+
+template <typename T>
+void write_array(std::ostream& out, const std::vector<T>& v) {
+    out.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+}
+
+template <typename T>
+void read_array(std::istream& in, std::vector<T>& v) {
+    in.read(reinterpret_cast<char*>(v.data()), v.size() * sizeof(T));
+}
+
+inline bool save_checkpoint(const std::string& path, const framebuffer& image, const checkpoint_info& info) {
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary);
+        checkpoint_header header = {{'R','T','C','K'}, checkpoint_version, image.width, image.height, info};
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_array(out, image.sum);
+        write_array(out, image.samples);
+        write_array(out, image.stats);
+        write_array(out, image.converged);
+        if (!out)
+            return false;
+    }
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+inline bool read_checkpoint(const std::string& path, framebuffer& image, checkpoint_info& info) {
+    // Reads any render state file, replacing image. Returns false if it is missing or malformed.
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+
+    checkpoint_header header;
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || std::string(header.magic, 4) != "RTCK" || header.version != checkpoint_version
+        || header.width <= 0 || header.height <= 0)
+        return false;
+
+    framebuffer loaded(header.width, header.height);
+    read_array(in, loaded.sum);
+    read_array(in, loaded.samples);
+    read_array(in, loaded.stats);
+    read_array(in, loaded.converged);
+    if (!in)
+        return false;
+
+    image = loaded;
+    info = header.info;
+    return true;
+}
+
+inline bool load_checkpoint(const std::string& path, framebuffer& image, checkpoint_info& info) {
+    // Resumes from path if it holds a checkpoint of the same render, setting info.next_pass.
+    // Returns false, leaving image untouched, otherwise.
+    framebuffer loaded(image.width, image.height);
+    checkpoint_info loaded_info;
+    if (!read_checkpoint(path, loaded, loaded_info))
+        return false;
+
+    if (loaded.width != image.width || loaded.height != image.height || !loaded_info.same_render(info)) {
+        std::clog << "Ignoring checkpoint " << path << ": written by a different render" << std::endl;
+        return false;
+    }
+
+    image = loaded;
+    info.next_pass = loaded_info.next_pass;
+    return true;
+}
+
+inline bool merge_shards(const std::vector<std::string>& paths, framebuffer& image) {
+    // Combines finished shard outputs whose sample ranges together cover each pixel's samples exactly
+    // once, failing on a missing, duplicated, overlapping or unfinished shard. Shards are added in
+    // sample order, the same order in which a single render with passes at the shard boundaries
+    // accumulates them, so merging every shard reproduces that render exactly.
+    std::vector<std::pair<checkpoint_info, framebuffer>> shards;
+    for (const auto& path : paths) {
+        framebuffer shard(0, 0);
+        checkpoint_info info;
+        if (!read_checkpoint(path, shard, info)) {
+            std::clog << "Could not read shard " << path << std::endl;
+            return false;
+        }
+        if (info.next_pass < info.num_passes()) {
+            // e.g., stopped by a time budget
+            std::clog << "Shard " << path << " is unfinished: " << info.next_pass << " of "
+                      << info.num_passes() << " passes rendered" << std::endl;
+            return false;
+        }
+        shards.push_back(std::make_pair(info, shard));
+    }
+    if (shards.empty())
+        return false;
+
+    std::sort(shards.begin(), shards.end(), [](const std::pair<checkpoint_info, framebuffer>& a, const std::pair<checkpoint_info, framebuffer>& b) {
+        return a.first.sample_begin < b.first.sample_begin;
+    });
+
+    const framebuffer& first = shards[0].second;
+    image = framebuffer(first.width, first.height);
+    int covered = 0;
+    for (size_t s = 0; s < shards.size(); s++) {
+        const checkpoint_info& info = shards[s].first;
+        const framebuffer& shard = shards[s].second;
+        if (shard.width != image.width || shard.height != image.height
+            || info.samples_per_pixel != shards[0].first.samples_per_pixel) {
+            std::clog << "Shards are from different renders" << std::endl;
+            return false;
+        }
+        int expected_begin = (s > 0) ? shards[s-1].first.sample_end : 0;
+        if (info.sample_begin < expected_begin) {
+            std::clog << "Shards overlap in samples " << info.sample_begin << "-" << expected_begin << std::endl;
+            return false;
+        }
+        if (info.sample_begin > expected_begin) {
+            std::clog << "No shard covers samples " << expected_begin << "-" << info.sample_begin << std::endl;
+            return false;
+        }
+
+        for (size_t index = 0; index < image.sum.size(); index++)
+            image.add(index, shard.sum[index], shard.samples[index]);
+        covered += info.sample_end - info.sample_begin;
+    }
+    int samples_per_pixel = shards[0].first.samples_per_pixel;
+    if (covered != samples_per_pixel) {
+        std::clog << "Shards cover samples 0-" << covered << " of " << samples_per_pixel << std::endl;
+        return false;
+    }
+
+    std::clog << "Merged " << shards.size() << " shards covering " << samples_per_pixel << " samples per pixel" << std::endl;
+    return true;
+}
+
+#endif
@@ -5,6 +5,11 @@
 
 #include <glm/glm.hpp>
 
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
 inline float linear_to_gamma(float linear_component) {
     // Map linear space to gamma space (which is what most image viewers are assuming) using gamma 2 approximation
     if (linear_component > 0)
@@ -13,38 +18,68 @@ inline float linear_to_gamma(float linear_component) {
     return 0;
 }
 
-void write_color(std::ostream& out, const glm::vec3& pixel_color) {
-    // Should be [0,1]
-    auto r = pixel_color.r;
-    auto g = pixel_color.g;
-    auto b = pixel_color.b;
+inline float luminance(const glm::vec3& color) {
+    // Relative luminance of a linear RGB color (Rec. 709 primaries)
+    return 0.2126f*color.r + 0.7152f*color.g + 0.0722f*color.b;
+}
 
-    // Account for NaN values
-    if (r != r) {
-        r = 0.0;
-        std::clog << "r value NaN!" << std::endl;
-    }
-    if (g != g) {
-        g = 0.0;
-        std::clog << "g value NaN!" << std::endl;
-    }
-    if (b != b) {
-        b = 0.0;
-        std::clog << "b value NaN!" << std::endl;
-    }
+enum class image_format {
+    ppm_ascii,      // P3, 8 bits per channel
+    ppm_binary,     // P6, 8 bits per channel
+    ppm_binary16    // P6, 16 bits per channel, big-endian
+};
 
-    // Gamma correction
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
+inline int quantize(float linear_component, int max_value) {
+    // Map linear [0,1] to gamma-corrected [0,max_value]
+    static const interval unit(0.0f, 1.0f);
+    float c = unit.clamp(linear_to_gamma(linear_component));
+    return int((max_value + 1) * std::fmin(c, 1.0f - 0.5f / (max_value + 1)));
+}
+
+inline int write_image(std::ostream& out, int width, int height, const std::vector<glm::vec3>& pixels,
+                       image_format format = image_format::ppm_binary) {
+    // Encodes the whole image into one buffer and writes it at once. NaN components are written as
+    // 0; returns the number of pixels that had any, for the caller to report.
+    int max_value = (format == image_format::ppm_binary16) ? 65535 : 255;
+    std::string buffer = (format == image_format::ppm_ascii) ? "P3\n" : "P6\n";
+    buffer += std::to_string(width) + ' ' + std::to_string(height) + '\n' + std::to_string(max_value) + '\n';
+    buffer.reserve(buffer.size() + pixels.size() * ((format == image_format::ppm_ascii) ? 12 : 6));
+
+    int nan_pixels = 0;
+    char text[32];
+    for (const auto& pixel_color : pixels) {
+        glm::vec3 color = pixel_color;
+        bool has_nan = false;
+        for (int c = 0; c < 3; c++) {
+            if (color[c] != color[c]) {
+                color[c] = 0;
+                has_nan = true;
+            }
+        }
+        nan_pixels += has_nan;
 
-    // Map [0,1] to [0,255]
-    static const interval intensity(0.000f, 0.999f);
-    int rbyte = 256 * intensity.clamp(r);
-    int gbyte = 256 * intensity.clamp(g);
-    int bbyte = 256 * intensity.clamp(b);
+        int r = quantize(color.r, max_value);
+        int g = quantize(color.g, max_value);
+        int b = quantize(color.b, max_value);
+
+        if (format == image_format::ppm_ascii) {
+            int n = std::snprintf(text, sizeof(text), "%d %d %d\n", r, g, b);
+            buffer.append(text, n);
+        } else if (format == image_format::ppm_binary) {
+            buffer += char(r);
+            buffer += char(g);
+            buffer += char(b);
+        } else {
+            for (int value : {r, g, b}) {
+                buffer += char(value >> 8);
+                buffer += char(value & 0xff);
+            }
+        }
+    }
 
-    out << rbyte << ' ' << gbyte << ' ' << bbyte << std::endl;
+    out.write(buffer.data(), buffer.size());
+    out.flush();
+    return nan_pixels;
 }
 
 #endif
\ No newline at end of file
@@ -64,6 +64,8 @@ class constant_medium : public hittable {
 
         aabb bounding_box() const override { return boundary->bounding_box(); }
 
+        bool splittable() const override { return false; }
+
     private:
         std::shared_ptr<hittable> boundary; 
         double neg_inv_density; // Scales the probability of scattering
@@ -0,0 +1,399 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "framebuffer.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Distributed rendering over local sockets
+// - A coordinator process leases image tiles to worker processes, which build the same scene, render
+//   each leased tile over all samples and stream the tile's float radiance sums back
+// - Addresses are either a Unix socket path or host:port for TCP
+// - Tiles leased to a worker that disconnects are returned to the queue, and tiles whose lease has
+//   run longer than the lease timeout are leased again to the next idle worker; since samples are
+//   keyed by pixel and sample index every lease of a tile returns the same result, so whichever
+//   arrives first is kept
+
+enum message_type : std::uint32_t {
+    message_hello  = 1,     // Worker -> coordinator: render settings, to reject mismatched workers
+    message_lease  = 2,     // Coordinator -> worker: tile to render
+    message_result = 3,     // Worker -> coordinator: leased tile's radiance sums and sample counts
+    message_done   = 4      // Coordinator -> worker: no more work
+};
+
+struct message_header {
+    std::uint32_t type;
+    std::uint32_t size;     // Payload bytes following the header
+};
+
+struct hello_message {
+    std::int32_t width, height;
+    std::int32_t samples_per_pixel;
+};
+
+struct lease_message {
+    std::int32_t tile_index;
+    tile region;
+};
+
+inline bool send_all(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool recv_all(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = ::recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool send_message(int fd, message_type type, const void* payload, size_t size) {
+    message_header header = {type, std::uint32_t(size)};
+    return send_all(fd, &header, sizeof(header)) && (size == 0 || send_all(fd, payload, size));
+}
+
+inline int open_socket(const std::string& address, bool listening) {
+    // Listens on or connects to a Unix socket path, or host:port for TCP. Returns -1 on failure.
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(addr.sun_path))
+            return -1;
+        std::strcpy(addr.sun_path, address.c_str());
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (listening)
+            ::unlink(address.c_str());
+        bool ok = listening
+            ? ::bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0 && ::listen(fd, 64) == 0
+            : ::connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+        if (!ok) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon + 1);
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    addrinfo* results;
+    if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &results) != 0)
+        return -1;
+
+    int fd = -1;
+    for (addrinfo* ai = results; ai != nullptr && fd < 0; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        bool ok;
+        if (listening) {
+            ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = ::bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, 64) == 0;
+        } else {
+            ok = ::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        }
+        if (!ok) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(results);
+    return fd;
+}
+
+class tile_coordinator {
+    public:
+        tile_coordinator(const std::string& address, const hello_message& settings, const std::vector<tile>& tiles, double lease_timeout_seconds)
+         : address(address), settings(settings), tiles(tiles), lease_timeout(lease_timeout_seconds)
+        {
+            // The largest valid message is the result for the largest tile
+            size_t max_area = 0;
+            for (const auto& t : tiles)
+                max_area = std::max(max_area, size_t(t.area()));
+            max_message_size = std::max(sizeof(hello_message),
+                                        sizeof(lease_message) + max_area * (sizeof(glm::vec3) + sizeof(int)));
+        }
+
+        bool run(framebuffer& image) {
+            // Leases every tile to workers until all results are in image
+            int listen_fd = open_socket(address, true);
+            if (listen_fd < 0) {
+                std::clog << "Coordinator could not listen on " << address << ": " << std::strerror(errno) << std::endl;
+                return false;
+            }
+            std::clog << "Coordinating " << tiles.size() << " tiles on " << address << std::endl;
+
+            completed.assign(tiles.size(), false);
+            for (size_t t = 0; t < tiles.size(); t++)
+                pending.push_back(t);
+            size_t remaining = tiles.size();
+
+            while (remaining > 0) {
+                std::vector<pollfd> fds(1, pollfd{listen_fd, POLLIN, 0});
+                for (const auto& c : connections)
+                    fds.push_back(pollfd{c.fd, POLLIN, 0});
+                ::poll(fds.data(), fds.size(), 1000);
+
+                for (size_t c = 0; c + 1 < fds.size(); c++) {
+                    if (fds[c+1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                        if (!receive(connections[c], image, remaining))
+                            drop(connections[c]);
+                    }
+                }
+                connections.erase(std::remove_if(connections.begin(), connections.end(),
+                    [](const connection& c) { return c.fd < 0; }), connections.end());
+
+                if (fds[0].revents & POLLIN) {
+                    int fd = ::accept(listen_fd, nullptr, nullptr);
+                    if (fd >= 0)
+                        connections.push_back(connection(fd));
+                }
+
+                requeue_stalled();
+                for (auto& c : connections) {
+                    if (c.ready && c.tile_index < 0 && !lease(c))
+                        drop(c);
+                }
+
+                std::clog << "\rTiles remaining: " << remaining << ", workers: " << connections.size() << "   " << std::flush;
+            }
+
+            for (auto& c : connections) {
+                send_message(c.fd, message_done, nullptr, 0);
+                ::close(c.fd);
+            }
+            ::close(listen_fd);
+            if (address.find(':') == std::string::npos)
+                ::unlink(address.c_str());
+
+            return true;
+        }
+
+    private:
+        struct connection {
+            int fd;
+            bool ready;         // Sent a matching hello
+            int tile_index;     // Leased tile, or -1 when idle
+            std::chrono::steady_clock::time_point leased_at;
+            std::vector<char> inbox;
+
+            connection(int fd) : fd(fd), ready(false), tile_index(-1) {}
+        };
+
+        std::string address;
+        hello_message settings;
+        std::vector<tile> tiles;
+        double lease_timeout;
+        size_t max_message_size;
+
+        std::vector<connection> connections;
+        std::deque<size_t> pending;
+        std::vector<char> completed;
+
+        bool receive(connection& c, framebuffer& image, size_t& remaining) {
+            // Reads what is available without blocking, then handles every complete message
+            char buffer[65536];
+            ssize_t n = ::recv(c.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                return false;
+            if (n > 0)
+                c.inbox.insert(c.inbox.end(), buffer, buffer + n);
+
+            while (c.inbox.size() >= sizeof(message_header)) {
+                message_header header;
+                std::memcpy(&header, c.inbox.data(), sizeof(header));
+                // Drop peers announcing more than any message holds, before buffering it
+                if (header.size > max_message_size)
+                    return false;
+                if (c.inbox.size() < sizeof(header) + header.size)
+                    break;
+                const char* payload = c.inbox.data() + sizeof(header);
+
+                if (header.type == message_hello && header.size == sizeof(hello_message)) {
+                    hello_message hello;
+                    std::memcpy(&hello, payload, sizeof(hello));
+                    if (hello.width != settings.width || hello.height != settings.height
+                        || hello.samples_per_pixel != settings.samples_per_pixel) {
+                        std::clog << "\nRejecting worker with different render settings" << std::endl;
+                        send_message(c.fd, message_done, nullptr, 0);
+                        return false;
+                    }
+                    c.ready = true;
+                } else if (header.type == message_result && header.size >= sizeof(lease_message)) {
+                    lease_message lease;
+                    std::memcpy(&lease, payload, sizeof(lease));
+                    // Only the tile leased to this worker, after its hello
+                    if (!c.ready || lease.tile_index < 0 || size_t(lease.tile_index) >= tiles.size()
+                        || lease.tile_index != c.tile_index)
+                        return false;
+                    const tile& t = tiles[lease.tile_index];
+                    size_t pixels = t.area();
+                    if (header.size != sizeof(lease) + pixels * (sizeof(glm::vec3) + sizeof(int)))
+                        return false;
+
+                    if (!completed[lease.tile_index]) {
+                        const char* sums = payload + sizeof(lease);
+                        const char* counts = sums + pixels * sizeof(glm::vec3);
+                        size_t p = 0;
+                        for (int j = t.y0; j < t.y1; j++) {
+                            for (int i = t.x0; i < t.x1; i++, p++) {
+                                glm::vec3 sum;
+                                int count;
+                                std::memcpy(&sum, sums + p * sizeof(glm::vec3), sizeof(sum));
+                                std::memcpy(&count, counts + p * sizeof(int), sizeof(count));
+                                image.add(j * image.width + i, sum, count);
+                            }
+                        }
+                        completed[lease.tile_index] = true;
+                        remaining--;
+                    }
+                    c.tile_index = -1;
+                } else {
+                    return false;
+                }
+
+                c.inbox.erase(c.inbox.begin(), c.inbox.begin() + sizeof(header) + header.size);
+            }
+
+            return true;
+        }
+
+        bool lease(connection& c) {
+            while (!pending.empty() && completed[pending.front()])
+                pending.pop_front();
+            if (pending.empty())
+                return true;
+
+            size_t t = pending.front();
+            pending.pop_front();
+            lease_message lease = {std::int32_t(t), tiles[t]};
+            c.tile_index = t;
+            c.leased_at = std::chrono::steady_clock::now();
+            return send_message(c.fd, message_lease, &lease, sizeof(lease));
+        }
+
+        void drop(connection& c) {
+            // Return the worker's leased tile to the front of the queue
+            if (c.fd < 0)
+                return;
+            if (c.tile_index >= 0 && !completed[c.tile_index])
+                pending.push_front(c.tile_index);
+            ::close(c.fd);
+            c.fd = -1;
+        }
+
+        void requeue_stalled() {
+            // Lease overdue tiles again; the stalled worker keeps its lease in case it finishes first
+            auto now = std::chrono::steady_clock::now();
+            for (auto& c : connections) {
+                if (c.tile_index < 0 || completed[c.tile_index])
+                    continue;
+                if (std::chrono::duration<double>(now - c.leased_at).count() < lease_timeout)
+                    continue;
+                if (std::find(pending.begin(), pending.end(), size_t(c.tile_index)) == pending.end())
+                    pending.push_front(c.tile_index);
+                c.leased_at = now;
+            }
+        }
+};
+
+inline bool run_tile_worker(const std::string& address, const hello_message& settings,
+                            const std::function<void(const tile&, framebuffer&)>& render_region) {
+    // Renders tiles leased by the coordinator at address until it has no more work.
+    // The coordinator may not be up yet, so keep trying to connect for a while.
+    int fd = -1;
+    for (int attempt = 0; attempt < 100 && fd < 0; attempt++) {
+        fd = open_socket(address, false);
+        if (fd < 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    if (fd < 0) {
+        std::clog << "Worker could not connect to " << address << std::endl;
+        return false;
+    }
+
+    if (!send_message(fd, message_hello, &settings, sizeof(settings))) {
+        ::close(fd);
+        return false;
+    }
+
+    framebuffer image(settings.width, settings.height);
+    int tiles_rendered = 0;
+    message_header header;
+    while (recv_all(fd, &header, sizeof(header)) && header.type == message_lease) {
+        lease_message lease;
+        if (header.size != sizeof(lease) || !recv_all(fd, &lease, sizeof(lease)))
+            break;
+
+        const tile& t = lease.region;
+        image.clear(t);
+        render_region(t, image);
+
+        std::vector<glm::vec3> sums;
+        std::vector<int> counts;
+        for (int j = t.y0; j < t.y1; j++) {
+            for (int i = t.x0; i < t.x1; i++) {
+                sums.push_back(image.sum[j * image.width + i]);
+                counts.push_back(image.samples[j * image.width + i]);
+            }
+        }
+
+        message_header result = {message_result, std::uint32_t(sizeof(lease) + sums.size() * sizeof(glm::vec3) + counts.size() * sizeof(int))};
+        if (!send_all(fd, &result, sizeof(result)) || !send_all(fd, &lease, sizeof(lease))
+            || !send_all(fd, sums.data(), sums.size() * sizeof(glm::vec3))
+            || !send_all(fd, counts.data(), counts.size() * sizeof(int)))
+            break;
+        tiles_rendered++;
+    }
+    ::close(fd);
+
+    std::clog << "\nWorker rendered " << tiles_rendered << " tiles" << std::endl;
+    return true;
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "rtweekend.h"
+#include "tile_scheduler.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class running_variance {
+    // Welford's online mean and variance
+    public:
+        int n = 0;
+        double mean = 0;
+        double m2 = 0;  // Sum of squared differences from the mean
+
+        void add(double x) {
+            n++;
+            double delta = x - mean;
+            mean += delta / n;
+            m2 += delta * (x - mean);
+        }
+
+        double variance() const {
+            return (n > 1) ? m2 / (n - 1) : 0;
+        }
+
+        double relative_error() const {
+            // Standard error of the mean relative to the mean, floored so black pixels don't divide by zero
+            return std::sqrt(variance() / n) / (std::fabs(mean) + 1e-3);
+        }
+};
+
+class framebuffer {
+    // Accumulates linear radiance and sample counts per pixel, so samples can be added over
+    // any number of passes and the image resolved at any point in between
+    public:
+        int width, height;
+        std::vector<glm::vec3> sum;     // Accumulated linear radiance
+        std::vector<int> samples;       // Samples accumulated
+
+        // Adaptive sampling state: running luminance statistics, and whether the pixel has converged
+        std::vector<running_variance> stats;
+        std::vector<char> converged;
+
+        framebuffer(int width, int height)
+         : width(width), height(height), sum(width * height, glm::vec3(0)), samples(width * height, 0),
+           stats(width * height), converged(width * height, false) {}
+
+        void add(int index, const glm::vec3& color_sum, int count) {
+            sum[index] += color_sum;
+            samples[index] += count;
+        }
+
+        void clear(const tile& region) {
+            for (int j = region.y0; j < region.y1; j++) {
+                for (int i = region.x0; i < region.x1; i++) {
+                    int index = j*width + i;
+                    sum[index] = glm::vec3(0);
+                    samples[index] = 0;
+                    stats[index] = running_variance();
+                    converged[index] = false;
+                }
+            }
+        }
+
+        glm::vec3 pixel(int index) const {
+            if (samples[index] == 0)
+                return glm::vec3(0);
+            return sum[index] * (1.0f / samples[index]);
+        }
+
+        long long total_samples() const {
+            long long total = 0;
+            for (int count : samples)
+                total += count;
+            return total;
+        }
+
+        std::vector<glm::vec3> resolve() const {
+            std::vector<glm::vec3> pixels(sum.size());
+            for (size_t index = 0; index < sum.size(); index++)
+                pixels[index] = pixel(index);
+            return pixels;
+        }
+};
+
+class snapshot_writer {
+    // Writes image snapshots to a file on a background thread
+    // - Only the latest pending snapshot is kept, so a slow disk drops intermediate snapshots
+    //   instead of holding up the render
+    // - Snapshots are written to a temporary file and renamed over the previous one, so a viewer
+    //   never sees a partially written image
+    public:
+        snapshot_writer(const std::string& path, image_format format)
+         : path(path), format(format), pending(false), stopping(false), thread(&snapshot_writer::run, this) {}
+
+        ~snapshot_writer() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_one();
+            thread.join();
+        }
+
+        void submit(int width, int height, std::vector<glm::vec3> pixels) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                next_width = width;
+                next_height = height;
+                next_pixels.swap(pixels);
+                pending = true;
+            }
+            cv.notify_one();
+        }
+
+    private:
+        std::string path;
+        image_format format;
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool pending;
+        bool stopping;
+        int next_width, next_height;
+        std::vector<glm::vec3> next_pixels;
+        std::thread thread;
+
+        void run() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                cv.wait(lock, [this]() { return pending || stopping; });
+                if (!pending)
+                    return;
+
+                int width = next_width;
+                int height = next_height;
+                std::vector<glm::vec3> pixels;
+                pixels.swap(next_pixels);
+                pending = false;
+
+                lock.unlock();
+                std::string tmp_path = path + ".tmp";
+                {
+                    std::ofstream out(tmp_path, std::ios::binary);
+                    write_image(out, width, height, pixels, format);
+                }
+                std::rename(tmp_path.c_str(), path.c_str());
+                lock.lock();
+            }
+        }
+};
+
+#endif
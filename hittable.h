@@ -31,6 +31,25 @@ class hittable {
 
         virtual aabb bounding_box() const = 0;
 
+        virtual aabb bounding_box_at(double time) const {
+            // Bounds at a time in the shutter interval [0, 1]. Moving objects give their bounds at times
+            // 0 and 1, and must stay within the linear blend of the two in between (see motion_bvh).
+            // Objects that don't know better give their bounds over the whole interval.
+            return bounding_box();
+        }
+
+        virtual aabb clipped_bounding_box(const aabb& region) const {
+            // Bounds of the part of the object inside region, for splitting it across BVH leaves.
+            // Objects that can't do better clip their bounding box.
+            return bounding_box().intersect(region);
+        }
+
+        virtual bool splittable() const {
+            // Whether several BVH leaves may reference the object. Objects that hit at random (e.g.,
+            // participating media) must be tested once per ray, or a ray gets more than one chance to hit.
+            return true;
+        }
+
         virtual double pdf_value(const glm::vec3& origin, const glm::vec3& direction) const {
             return 0;
         }
@@ -45,6 +64,17 @@ class translate : public hittable {
         translate(std::shared_ptr<hittable> object, const glm::vec3& offset)
          : object(object), offset(offset) 
         {  
+            set_bounding_box();
+        }
+
+        void set_offset(const glm::vec3& new_offset) {
+            // Moves the object between frames; BVHs containing it pick up the new bounds on refit()
+            offset = new_offset;
+            set_bounding_box();
+        }
+
+        void set_bounding_box() {
+            // Also call after the wrapped object's bounds change (e.g., a BVH that was refit)
             bbox = object->bounding_box() + offset; // + operator is overloaded and acts as a displacement
         }
         
@@ -63,6 +93,10 @@ class translate : public hittable {
         }
         
         aabb bounding_box() const override { return bbox; }
+
+        aabb bounding_box_at(double time) const override { return object->bounding_box_at(time) + offset; }
+
+        bool splittable() const override { return object->splittable(); }
     
     private:
         std::shared_ptr<hittable> object;
@@ -75,11 +109,23 @@ class rotate_y : public hittable {
         rotate_y(std::shared_ptr<hittable> object, double angle)
          : object(object)
         {
+            set_angle(angle);
+        }
+
+        void set_angle(double angle) {
+            // Turns the object between frames; BVHs containing it pick up the new bounds on refit()
             double radians = glm::radians(angle);
             cos_theta = std::cos(radians);
             sin_theta = std::sin(radians);
-            bbox = object->bounding_box();
+            set_bounding_box();
+        }
+
+        void set_bounding_box() {
+            // Also call after the wrapped object's bounds change (e.g., a BVH that was refit)
+            bbox = rotated_box(object->bounding_box());
+        }
 
+        aabb rotated_box(const aabb& box) const {
             // Compute the aabb of the rotated object by rotating each corner of the current bounding box 
             // and updating the min and max coordinates if they are exceeded
             glm::vec3 min(infinity, infinity, infinity);
@@ -87,12 +133,13 @@ class rotate_y : public hittable {
             for (int i = 0; i < 2; i++)
                 for (int j = 0; j < 2; j++)
                     for (int k = 0; k < 2; k++) {
-                        float x = i*bbox.x.max + (1-i)*bbox.x.min;
-                        float y = j*bbox.y.max + (1-j)*bbox.y.min;
-                        float z = k*bbox.z.max + (1-k)*bbox.z.min;
+                        float x = i*box.x.max + (1-i)*box.x.min;
+                        float y = j*box.y.max + (1-j)*box.y.min;
+                        float z = k*box.z.max + (1-k)*box.z.min;
 
-                        float newx = cos_theta * x - sin_theta * z;
-                        float newz = sin_theta * x + cos_theta * z;
+                        // Object space to world space, as hit() maps hit points back
+                        float newx = cos_theta * x + sin_theta * z;
+                        float newz = -sin_theta * x + cos_theta * z;
 
                         glm::vec3 tester(newx, y, newz);
 
@@ -102,7 +149,7 @@ class rotate_y : public hittable {
                         }
                     }
             
-            bbox = aabb(min, max);
+            return aabb(min, max);
         }
         
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
@@ -139,6 +186,10 @@ class rotate_y : public hittable {
         }
         
         aabb bounding_box() const override { return bbox; }
+
+        aabb bounding_box_at(double time) const override { return rotated_box(object->bounding_box_at(time)); }
+
+        bool splittable() const override { return object->splittable(); }
     
     private:
         std::shared_ptr<hittable> object;
@@ -44,6 +44,20 @@ class hittable_list : public hittable {
 
         aabb bounding_box() const override { return bbox; }
 
+        aabb bounding_box_at(double time) const override {
+            aabb box = aabb::empty;
+            for (const auto& object : objects)
+                box = aabb(box, object->bounding_box_at(time));
+            return box;
+        }
+
+        bool splittable() const override {
+            for (const auto& object : objects)
+                if (!object->splittable())
+                    return false;
+            return true;
+        }
+
         double pdf_value(const glm::vec3& origin, const glm::vec3& direction) const override {
             double weight = 1.0 / objects.size();
             double sum = 0.0;
@@ -0,0 +1,81 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+class instance : public hittable {
+    // Copy of a shared object (typically a BVH, the bottom level) placed in the world by an affine
+    // transform, for use as the object of a top-level BVH
+    // - Unlike nesting translate and rotate_y, any combination of translation, rotation and scale is
+    //   one matrix, so a ray is transformed once per instance
+    // - Instances of the same object share its memory; only the matrices are per instance
+    public:
+        instance(std::shared_ptr<hittable> object, const glm::mat4& transform)
+         : object(object)
+        {
+            set_transform(transform);
+        }
+
+        void set_transform(const glm::mat4& transform) {
+            // Moves the instance between frames; BVHs containing it pick up the new bounds on refit()
+            to_world = glm::mat4x3(transform);
+            to_object = glm::mat4x3(glm::inverse(transform));
+            // Normals transform by the inverse transpose, to stay perpendicular under non-uniform scale
+            normal_to_world = glm::transpose(glm::mat3(to_object));
+            set_bounding_box();
+        }
+
+        void set_bounding_box() {
+            // Also call after the object's bounds change (e.g., a BVH that was refit)
+            bbox = transformed_box(object->bounding_box());
+        }
+
+        bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            // The direction isn't renormalized, so t means the same distance along the ray in both spaces
+            // and ray_t carries over unchanged
+            ray object_r(to_object * glm::vec4(r.origin(), 1), to_object * glm::vec4(r.direction(), 0), r.time());
+
+            if (!object->hit(object_r, ray_t, rec))
+                return false;
+
+            // The face side was decided in object space; transforming the direction and normal together
+            // preserves the sign of their dot product, so it still holds
+            rec.p = to_world * glm::vec4(rec.p, 1);
+            rec.normal = glm::normalize(normal_to_world * rec.normal);
+
+            return true;
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        aabb bounding_box_at(double time) const override { return transformed_box(object->bounding_box_at(time)); }
+
+        bool splittable() const override { return object->splittable(); }
+
+    private:
+        std::shared_ptr<hittable> object;
+        glm::mat4x3 to_world;       // Object space to world space (3x4: linear part and translation)
+        glm::mat4x3 to_object;      // Its inverse
+        glm::mat3 normal_to_world;
+        aabb bbox;
+
+        aabb transformed_box(const aabb& object_box) const {
+            // The box around the transformed corners of object_box
+            glm::vec3 min(infinity), max(-infinity);
+            for (int i = 0; i < 8; i++) {
+                glm::vec3 corner(object_box.x.min, object_box.y.min, object_box.z.min);
+                if (i & 1) corner.x = object_box.x.max;
+                if (i & 2) corner.y = object_box.y.max;
+                if (i & 4) corner.z = object_box.z.max;
+
+                glm::vec3 transformed = to_world * glm::vec4(corner, 1);
+                min = glm::min(min, transformed);
+                max = glm::max(max, transformed);
+            }
+            return aabb(min, max);
+        }
+};
+
+#endif
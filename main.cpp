@@ -6,10 +6,16 @@
 #include "material.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "instance.h"
 #include "sphere.h"
 #include "quad.h"
 
-void bouncing_spheres() {
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+void bouncing_spheres(camera& cam) {
     hittable_list world;
 
     auto ground_material = std::make_shared<lambertian>(glm::vec3(0.5, 0.5, 0.5));
@@ -56,9 +62,7 @@ void bouncing_spheres() {
     auto material3 = std::make_shared<metal>(glm::vec3(0.7, 0.6, 0.5), 0.0);
     world.add(std::make_shared<sphere>(glm::vec3(4, 1, 0), 1.0, material3));
 
-    world = hittable_list(std::make_shared<bvh_node>(world)); // bvh_node wraps current hittables, making it optional
-
-    camera cam;
+    world = hittable_list(make_bvh(world)); // bvh_node wraps current hittables, making it optional
 
     // RENDER SETTINGS
     cam.aspect_ratio      = 16.0 / 9.0;
@@ -75,7 +79,7 @@ void bouncing_spheres() {
     cam.defocus_angle = 0.6;
     cam.focus_dist    = 10.0;
 
-    // cam.render(world);
+    cam.render(world);
 }
 
 // For image_width = 400, samples_per_pixel = 50, max_depth = 10
@@ -83,7 +87,7 @@ void bouncing_spheres() {
     // With BVH random axis split: 1.79 min
     // With BVH longest axis split: 1.79 min
 
-void checkered_spheres() {
+void checkered_spheres(camera& cam) {
     hittable_list world;
 
     auto checker_tex = std::make_shared<checker_texture>(0.32, glm::vec3(.2, .3, .1), glm::vec3(.9, .9, .9));
@@ -91,8 +95,8 @@ void checkered_spheres() {
     world.add(std::make_shared<sphere>(glm::vec3(0,-10,0), 10, checker_material));
     world.add(std::make_shared<sphere>(glm::vec3(0, 10,0), 10, checker_material));
 
-    camera cam;
-    
+    world = hittable_list(make_bvh(world));
+
     // RENDER SETTINGS
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 400;
@@ -107,17 +111,16 @@ void checkered_spheres() {
 
     cam.defocus_angle = 0;;
 
-    // cam.render(world);
+    cam.render(world);
 }
 
-void earth() {
+void earth(camera& cam) {
     auto earth_texture = std::make_shared<image_texture>("images/earthmap.jpg");
     auto earth_material = std::make_shared<lambertian>(earth_texture);
     
     auto globe = std::make_shared<sphere>(glm::vec3(0,0,0), 2, earth_material);
+    hittable_list world(make_bvh(hittable_list(globe)));
 
-    camera cam;
-    
     // RENDER SETTINGS
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 400;
@@ -132,10 +135,10 @@ void earth() {
 
     cam.defocus_angle = 0;
 
-    // cam.render(*globe);
+    cam.render(world);
 }
 
-void perlin_spheres() {
+void perlin_spheres(camera& cam) {
     hittable_list world;
 
     auto perlin_tex = std::make_shared<noise_texture>(4);
@@ -143,8 +146,8 @@ void perlin_spheres() {
     world.add(std::make_shared<sphere>(glm::vec3(0,-1000,0), 1000, perlin_material));
     world.add(std::make_shared<sphere>(glm::vec3(0,2,0), 2, perlin_material));
 
-    camera cam;
-    
+    world = hittable_list(make_bvh(world));
+
     // RENDER SETTINGS
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 400;
@@ -159,10 +162,10 @@ void perlin_spheres() {
 
     cam.defocus_angle = 0;
 
-    // cam.render(world); 
+    cam.render(world);
 }
 
-void quads() {
+void quads(camera& cam) {
     hittable_list world;
 
     // Materials
@@ -179,7 +182,7 @@ void quads() {
     world.add(std::make_shared<quad>(glm::vec3(-2, 3, 1), glm::vec3(4, 0, 0), glm::vec3(0, 0, 4), upper_orange));
     world.add(std::make_shared<quad>(glm::vec3(-2,-3, 5), glm::vec3(4, 0, 0), glm::vec3(0, 0,-4), lower_teal));
 
-    camera cam;
+    world = hittable_list(make_bvh(world));
 
     cam.aspect_ratio      = 1.0;
     cam.image_width       = 400;
@@ -194,10 +197,10 @@ void quads() {
 
     cam.defocus_angle = 0;
 
-    // cam.render(world);
+    cam.render(world);
 }
 
-void simple_light() {
+void simple_light(camera& cam) {
     hittable_list world;
 
     auto perlin_texture = std::make_shared<noise_texture>(4);
@@ -209,7 +212,7 @@ void simple_light() {
     world.add(std::make_shared<sphere>(glm::vec3(2,5,2), 0.5, diff_light));
     world.add(std::make_shared<quad>(glm::vec3(3,1,-2), glm::vec3(2,0,0), glm::vec3(0,2,0), diff_light));
 
-    camera cam;
+    world = hittable_list(make_bvh(world));
 
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 400;
@@ -224,10 +227,10 @@ void simple_light() {
 
     cam.defocus_angle = 0;
 
-    // cam.render(world);
+    cam.render(world);
 }
 
-void cornell_box() {
+void cornell_box(camera& cam) {
     hittable_list world;
 
     auto red   = std::make_shared<lambertian>(glm::vec3(.65, .05, .05));
@@ -265,8 +268,6 @@ void cornell_box() {
     // Glass sphere
     lights.add(std::make_shared<sphere>(glm::vec3(190,90,190), 90, empty_material));
 
-    camera cam;
-
     cam.aspect_ratio      = 1.0;
     cam.image_width       = 800;
     cam.samples_per_pixel = 1000;
@@ -280,10 +281,11 @@ void cornell_box() {
 
     cam.defocus_angle = 0;
 
+    world = hittable_list(make_bvh(world));
     cam.render(world, lights);
 }
 
-void cornell_smoke() {
+void cornell_smoke(camera& cam) {
     hittable_list world;
 
     auto red   = std::make_shared<lambertian>(glm::vec3(.65, .05, .05));
@@ -309,8 +311,6 @@ void cornell_smoke() {
     world.add(std::make_shared<constant_medium>(box1, 0.01, glm::vec3(0,0,0)));
     world.add(std::make_shared<constant_medium>(box2, 0.01, glm::vec3(1,1,1)));
 
-    camera cam;
-
     cam.aspect_ratio      = 1.0;
     cam.image_width       = 600;
     cam.samples_per_pixel = 50;
@@ -324,15 +324,17 @@ void cornell_smoke() {
 
     cam.defocus_angle = 0;
 
-    // cam.render(world);
+    world = hittable_list(make_bvh(world));
+    cam.render(world);
 }
 
-void final_scene(int image_width, int samples_per_pixel, int max_depth) {
+void final_scene(camera& cam, int image_width, int samples_per_pixel, int max_depth) {
     hittable_list world;
     
-    // Mint green cubes at varying heights
+    // Mint green cubes at varying heights, all instances of one unit cube
     hittable_list boxes1;
     auto ground = std::make_shared<lambertian>(glm::vec3(0.48, 0.83, 0.53));
+    auto unit_box = make_bvh(*box(glm::vec3(0,0,0), glm::vec3(1,1,1), ground));
     int boxes_per_side = 20;
     for (int i = 0; i < boxes_per_side; i++) {
         for (int j = 0; j < boxes_per_side; j++) {
@@ -344,10 +346,12 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
             auto y1 = random_double(1,101);
             auto z1 = z0 + w;
 
-            boxes1.add(box(glm::vec3(x0,y0,z0), glm::vec3(x1,y1,z1), ground));
+            glm::mat4 transform = glm::translate(glm::mat4(1), glm::vec3(x0,y0,z0))
+                                * glm::scale(glm::mat4(1), glm::vec3(x1-x0, y1-y0, z1-z0));
+            boxes1.add(std::make_shared<instance>(unit_box, transform));
         }
     }
-    world.add(std::make_shared<bvh_node>(boxes1));
+    world.add(make_bvh(boxes1));
 
     // Diffuse white light quad
     auto light = std::make_shared<diffuse_light>(glm::vec3(7, 7, 7));
@@ -387,14 +391,9 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     for (int j = 0; j < ns; j++) {
         boxes2.add(std::make_shared<sphere>(random_vector(0,165), 10, white));
     }
-    world.add(std::make_shared<translate>(
-        std::make_shared<rotate_y>(
-            std::make_shared<bvh_node>(boxes2), 15),
-            glm::vec3(-100,270,395)
-        )
-    );
-
-    camera cam;
+    glm::mat4 transform = glm::translate(glm::mat4(1), glm::vec3(-100,270,395))
+                        * glm::rotate(glm::mat4(1), glm::radians(15.0f), glm::vec3(0,1,0));
+    world.add(std::make_shared<instance>(make_bvh(boxes2), transform));
 
     cam.aspect_ratio      = 1.0;
     cam.image_width       = image_width;
@@ -409,20 +408,109 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
 
     cam.defocus_angle = 0;
 
-    // cam.render(world);
+    cam.render(world);
 }
 
-int main() {
-    switch (7) {
-        case 1:  bouncing_spheres();          break;
-        case 2:  checkered_spheres();         break;
-        case 3:  earth();                     break;
-        case 4:  perlin_spheres();            break;
-        case 5:  quads();                     break;
-        case 6:  simple_light();              break;
-        case 7:  cornell_box();               break;
-        case 8:  cornell_smoke();             break;
-        case 9:  final_scene(800, 10000, 40); break;
-        case 10: final_scene(800,  1000, 40); break;
+int usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--scene N] [--threads N] [--format p3|p6|p6-16]"
+              << " [--bvh median|sah|lbvh|sbvh] [--sah-bins N] [--bvh-width 2|4|8]"
+              << " [--bvh-quantized] [--bvh-leaf-size N] [--bvh-treelets PASSES]"
+              << " [--bvh-cache DIR] [--bvh-stats]"
+              << " [--coordinator ADDRESS | --worker ADDRESS] [--lease-timeout SECONDS]"
+              << " [--shard I/N [--shard-output PATH]]\n"
+              << "       " << program << " [--format p3|p6|p6-16] --merge SHARD...\n"
+              << "  ADDRESS is a Unix socket path or host:port\n";
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    camera cam;
+    int scene = 7;
+    std::string shard_output;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i+1 < argc;
+        if (arg == "--scene" && has_value) {
+            scene = std::atoi(argv[++i]);
+        } else if (arg == "--threads" && has_value) {
+            cam.num_threads = std::atoi(argv[++i]);
+        } else if (arg == "--bvh" && has_value) {
+            std::string split = argv[++i];
+            if (split == "median")
+                default_bvh_options().split = bvh_split::median;
+            else if (split == "sah")
+                default_bvh_options().split = bvh_split::sah;
+            else if (split == "lbvh")
+                default_bvh_options().split = bvh_split::lbvh;
+            else if (split == "sbvh")
+                default_bvh_options().split = bvh_split::sbvh;
+            else
+                return usage(argv[0]);
+        } else if (arg == "--bvh-width" && has_value) {
+            default_bvh_options().width = std::atoi(argv[++i]);
+        } else if (arg == "--bvh-cache" && has_value) {
+            default_bvh_options().cache_dir = argv[++i];
+        } else if (arg == "--bvh-quantized") {
+            default_bvh_options().quantized = true;
+        } else if (arg == "--bvh-leaf-size" && has_value) {
+            default_bvh_options().max_leaf_size = std::atoi(argv[++i]);
+        } else if (arg == "--bvh-stats") {
+            default_bvh_options().report_stats = true;
+        } else if (arg == "--bvh-treelets" && has_value) {
+            default_bvh_options().treelet_passes = std::atoi(argv[++i]);
+        } else if (arg == "--sah-bins" && has_value) {
+            default_bvh_options().sah_bins = std::atoi(argv[++i]);
+        } else if (arg == "--coordinator" && has_value) {
+            cam.coordinator_address = argv[++i];
+        } else if (arg == "--worker" && has_value) {
+            cam.worker_address = argv[++i];
+        } else if (arg == "--lease-timeout" && has_value) {
+            cam.lease_timeout_seconds = std::atof(argv[++i]);
+        } else if (arg == "--shard" && has_value
+                   && std::sscanf(argv[++i], "%d/%d", &cam.shard_index, &cam.shard_count) == 2
+                   && 0 <= cam.shard_index && cam.shard_index < cam.shard_count) {
+        } else if (arg == "--shard-output" && has_value) {
+            shard_output = argv[++i];
+        } else if (arg == "--format" && has_value) {
+            std::string format = argv[++i];
+            if (format == "p3")
+                cam.output_format = image_format::ppm_ascii;
+            else if (format == "p6")
+                cam.output_format = image_format::ppm_binary;
+            else if (format == "p6-16")
+                cam.output_format = image_format::ppm_binary16;
+            else
+                return usage(argv[0]);
+        } else if (arg == "--merge" && has_value) {
+            // Combine shard outputs into an image on stdout
+            framebuffer image(0, 0);
+            if (!merge_shards(std::vector<std::string>(argv + i+1, argv + argc), image))
+                return 1;
+            int nan_pixels = write_image(std::cout, image.width, image.height, image.resolve(), cam.output_format);
+            if (nan_pixels > 0)
+                std::clog << nan_pixels << " pixels had NaN components, written as 0" << std::endl;
+            return 0;
+        } else {
+            return usage(argv[0]);
+        }
     }
-}
\ No newline at end of file
+
+    if (!shard_output.empty())
+        cam.shard_path = shard_output;
+    else if (cam.shard_count > 1)
+        cam.shard_path = "shard_" + std::to_string(cam.shard_index) + "_of_" + std::to_string(cam.shard_count) + ".bin";
+
+    switch (scene) {
+        case 1:  bouncing_spheres(cam);            break;
+        case 2:  checkered_spheres(cam);           break;
+        case 3:  earth(cam);                       break;
+        case 4:  perlin_spheres(cam);              break;
+        case 5:  quads(cam);                       break;
+        case 6:  simple_light(cam);                break;
+        case 7:  cornell_box(cam);                 break;
+        case 8:  cornell_smoke(cam);               break;
+        case 9:  final_scene(cam, 800, 10000, 40); break;
+        case 10: final_scene(cam, 800,  1000, 40); break;
+    }
+}
@@ -27,6 +27,42 @@ class quad : public hittable {
         
         aabb bounding_box() const override { return bbox; }
 
+        aabb clipped_bounding_box(const aabb& region) const override {
+            // Clip the quad's outline against each face of region (Sutherland-Hodgman) and bound the rest
+            std::vector<glm::vec3> polygon = {Q, Q + u, Q + u + v, Q + v};
+            for (int axis = 0; axis < 3; axis++) {
+                for (int side = 0; side < 2; side++) {
+                    // Points with a non-negative distance are on region's side of the face
+                    const interval& bounds = region.axis_interval(axis);
+                    auto distance = [&](const glm::vec3& p) {
+                        return (side == 0) ? p[axis] - bounds.min : bounds.max - p[axis];
+                    };
+
+                    std::vector<glm::vec3> clipped;
+                    for (size_t i = 0; i < polygon.size(); i++) {
+                        const glm::vec3& a = polygon[i];
+                        const glm::vec3& b = polygon[(i + 1) % polygon.size()];
+                        float da = distance(a), db = distance(b);
+                        if (da >= 0)
+                            clipped.push_back(a);
+                        if ((da >= 0) != (db >= 0))
+                            clipped.push_back(a + (b - a) * (da / (da - db)));
+                    }
+                    polygon.swap(clipped);
+                }
+            }
+
+            if (polygon.empty())
+                return aabb::empty;
+
+            glm::vec3 min = polygon[0], max = polygon[0];
+            for (const auto& p : polygon) {
+                min = glm::min(min, p);
+                max = glm::max(max, p);
+            }
+            return aabb(min, max).intersect(region);
+        }
+
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
             // Ray is parallel to plane
             double denom = glm::dot(normal, r.direction());
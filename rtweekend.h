@@ -15,13 +15,17 @@
 #include <glm/gtx/norm.hpp>
 #include <glm/gtc/constants.hpp>
 
+#include "sampler.h"
+
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = glm::pi<double>();
 
+// Sampler of the calling thread. The camera keys it by (pixel, sample index) before tracing each
+// sample, so every random draw below is reproducible regardless of which thread makes it.
+thread_local sampler thread_sampler;
+
 inline double random_double() {
-    static std::default_random_engine generator(1);
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    return distribution(generator);
+    return thread_sampler.next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -29,19 +33,15 @@ inline double random_double(double min, double max) {
 }
 
 inline float random_float() {
-    static std::default_random_engine generator(2);
-    static std::uniform_real_distribution<float> distribution(0.0, 1.0);
-    return distribution(generator);
+    return thread_sampler.next_float();
 }
 
 inline float random_float(float min, float max) {
     return min + (max - min) * random_float();
 }
 
-inline float random_int(int min, int max) {
-    static std::default_random_engine generator(4);
-    static std::uniform_int_distribution<int> distribution(min, max);
-    return distribution(generator);
+inline int random_int(int min, int max) {
+    return thread_sampler.next_int(min, max);
 }
 
 inline glm::vec3 random_cosine_direction() {
@@ -0,0 +1,60 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+
+class sampler {
+    // Counter-based random number generator
+    // - Each draw is a pure function of a 64-bit stream key and the draw's dimension (its index
+    //   within the stream), so there is no generator state to share between threads and any draw
+    //   can be reproduced without replaying the ones before it
+    // - Camera samples are keyed by (pixel, sample index), which makes every path the same no
+    //   matter which thread, tile or process traces it
+    // - Draws are the SplitMix64 output function applied to key + dimension * golden gamma
+    public:
+        // Scene stream, used for everything drawn outside of camera samples (e.g., scene setup)
+        sampler() : sampler(~std::uint64_t(0)) {}
+
+        explicit sampler(std::uint64_t stream)
+         : key(mix(stream)), dimension(0) {}
+
+        void start_sample(std::uint32_t pixel_index, std::uint32_t sample_index) {
+            key = mix((std::uint64_t(pixel_index) << 32) | sample_index);
+            dimension = 0;
+        }
+
+        // Number of values drawn from the current stream
+        std::uint64_t position() const { return dimension; }
+
+        std::uint64_t next() {
+            return mix(key + (++dimension) * 0x9e3779b97f4a7c15ull);
+        }
+
+        double next_double() {
+            // Top 53 bits as a double in [0,1)
+            return (next() >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+        float next_float() {
+            // Top 24 bits as a float in [0,1)
+            return (next() >> 40) * (1.0f / 16777216.0f);
+        }
+
+        int next_int(int min, int max) {
+            // Integer in [min,max] by fixed-point multiplication of the top 32 bits
+            std::uint64_t range = std::uint64_t(std::int64_t(max) - min) + 1;
+            return min + int(((next() >> 32) * range) >> 32);
+        }
+
+    private:
+        std::uint64_t key;
+        std::uint64_t dimension;
+
+        static std::uint64_t mix(std::uint64_t z) {
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+};
+
+#endif
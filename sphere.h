@@ -69,6 +69,11 @@ class sphere : public hittable {
 
         aabb bounding_box() const override { return bbox; }
 
+        aabb bounding_box_at(double time) const override {
+            glm::vec3 current_center = center.at(time);
+            return aabb(current_center - radius, current_center + radius);
+        }
+
         double pdf_value(const glm::vec3& origin, const glm::vec3& direction) const override {
             hit_record rec;
             if (!hit(ray(origin, direction), interval(0.001, infinity), rec))
@@ -0,0 +1,177 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct tile {
+    int x0, y0;     // Upper left pixel, inclusive
+    int x1, y1;     // Lower right pixel, exclusive
+
+    int width() const  { return x1 - x0; }
+    int height() const { return y1 - y0; }
+    int area() const   { return width() * height(); }
+};
+
+enum class tile_order {
+    scanline,   // Row-major, top to bottom
+    spiral,     // Rings outward from the image center, where the expensive tiles usually are
+    hilbert     // Along a Hilbert curve, for cache locality between consecutive tiles
+};
+
+struct tile_timing {
+    tile t;
+    int worker;
+    double start;   // Seconds since the render started
+    double seconds; // Time spent rendering the tile
+};
+
+inline std::vector<tile> make_tiles(const tile& region, int tile_w, int tile_h, tile_order order) {
+    // Cover region with tiles of at most tile_w x tile_h pixels, in the given order
+    std::vector<tile> tiles;
+    for (int y = region.y0; y < region.y1; y += tile_h)
+        for (int x = region.x0; x < region.x1; x += tile_w)
+            tiles.push_back({x, y, std::min(x + tile_w, region.x1), std::min(y + tile_h, region.y1)});
+
+    if (order == tile_order::spiral) {
+        // Sort by square ring around the center tile, then by angle within each ring
+        float cx = (region.width() / float(tile_w) - 1) / 2;
+        float cy = (region.height() / float(tile_h) - 1) / 2;
+        std::stable_sort(tiles.begin(), tiles.end(), [&](const tile& a, const tile& b) {
+            float ax = (a.x0 - region.x0) / tile_w - cx, ay = (a.y0 - region.y0) / tile_h - cy;
+            float bx = (b.x0 - region.x0) / tile_w - cx, by = (b.y0 - region.y0) / tile_h - cy;
+            float ring_a = std::fmax(std::fabs(ax), std::fabs(ay));
+            float ring_b = std::fmax(std::fabs(bx), std::fabs(by));
+            if (ring_a != ring_b)
+                return ring_a < ring_b;
+            return std::atan2(ay, ax) < std::atan2(by, bx);
+        });
+    } else if (order == tile_order::hilbert) {
+        int nx = (region.width() + tile_w - 1) / tile_w;
+        int ny = (region.height() + tile_h - 1) / tile_h;
+        int n = 1;
+        while (n < nx || n < ny)
+            n *= 2;
+
+        auto hilbert_index = [n](int x, int y) {
+            // Distance along an n x n Hilbert curve (n a power of 2) of cell (x, y)
+            int d = 0;
+            for (int s = n/2; s > 0; s /= 2) {
+                int rx = (x & s) > 0;
+                int ry = (y & s) > 0;
+                d += s * s * ((3 * rx) ^ ry);
+                if (ry == 0) {
+                    if (rx == 1) {
+                        x = s-1 - x;
+                        y = s-1 - y;
+                    }
+                    std::swap(x, y);
+                }
+            }
+            return d;
+        };
+        std::stable_sort(tiles.begin(), tiles.end(), [&](const tile& a, const tile& b) {
+            return hilbert_index((a.x0 - region.x0) / tile_w, (a.y0 - region.y0) / tile_h)
+                 < hilbert_index((b.x0 - region.x0) / tile_w, (b.y0 - region.y0) / tile_h);
+        });
+    }
+
+    return tiles;
+}
+
+class tile_scheduler {
+    // Work-stealing tile queue
+    // - Each worker owns a deque, seeded round-robin from the ordered tile list, and takes tiles from
+    //   its front so that it works through them in order
+    // - A worker whose deque runs dry steals from the back of the other deques
+    // - While other workers are idle, a worker halves the tile it just took (down to min_tile_size)
+    //   and pushes the other halves onto the back of its deque, where they are stolen first
+    public:
+        tile_scheduler(int num_workers, int min_tile_size)
+         : queues(num_workers), min_tile_size(min_tile_size), idle_workers(0), queued(0) {}
+
+        void seed(const std::vector<tile>& tiles) {
+            for (size_t t = 0; t < tiles.size(); t++)
+                queues[t % queues.size()].tiles.push_back(tiles[t]);
+            queued += tiles.size();
+        }
+
+        bool next(int worker, tile& out) {
+            if (take(worker, worker, out))
+                return true;
+
+            idle_workers++;
+            int n = queues.size();
+            while (queued > 0) {
+                for (int k = 1; k < n; k++) {
+                    if (take(worker, (worker + k) % n, out)) {
+                        idle_workers--;
+                        return true;
+                    }
+                }
+                std::this_thread::yield();
+            }
+            idle_workers--;
+
+            return false;
+        }
+
+    private:
+        struct worker_queue {
+            std::mutex mutex;
+            std::deque<tile> tiles;
+        };
+
+        std::vector<worker_queue> queues;
+        int min_tile_size;
+        std::atomic<int> idle_workers;
+        std::atomic<size_t> queued;    // Tiles in all deques; only reaches 0 once no more can appear
+
+        bool take(int worker, int victim, tile& out) {
+            {
+                worker_queue& q = queues[victim];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                if (q.tiles.empty())
+                    return false;
+                if (victim == worker) {
+                    out = q.tiles.front();
+                    q.tiles.pop_front();
+                } else {
+                    out = q.tiles.back();
+                    q.tiles.pop_back();
+                }
+            }
+
+            // Split before releasing the taken tile from the count, so idle workers keep looking
+            split_for_idle(worker, out);
+            queued--;
+
+            return true;
+        }
+
+        void split_for_idle(int worker, tile& t) {
+            int pushed = 0;
+            while (pushed < idle_workers && (t.width() >= 2*min_tile_size || t.height() >= 2*min_tile_size)) {
+                tile other = t;
+                if (t.width() >= t.height()) {
+                    t.x1 = other.x0 = t.x0 + t.width()/2;
+                } else {
+                    t.y1 = other.y0 = t.y0 + t.height()/2;
+                }
+
+                worker_queue& q = queues[worker];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                q.tiles.push_back(other);
+                queued++;
+                pushed++;
+            }
+        }
+};
+
+#endif